@@ -8,19 +8,169 @@
 #include <assert.h>
 #include <unistd.h>
 #include <algorithm>
+#include <limits>
+#include <string.h>
 #include <sys/time.h> // for gettimeofday(3)
+#include <sys/resource.h> // for getrusage(2)
+#include <getopt.h>
 #include "antix.h"
 using namespace Antix;
 
 static uint64_t score_time( 200 );
 static double start_seconds(0);
+static double init_seconds(0); // when Init() was called, before the world was created
+static bool started(false); // whether this run has done an update yet
+static double first_update_seconds(0); // when this run's first update started, excluding world creation
+static uint64_t first_update(0); // the update this run started at, later than 0 if restored
 
-static pthread_mutex_t sync_mutex;
-static pthread_cond_t cond_start;
-static pthread_cond_t cond_done;
-static unsigned int worker_count;
+const char* Antix::phase_names[PHASE_COUNT] = { "pucks", "pose", "sense", "control", "layout", "exchange", "subgrid" };
+static double phase_seconds[PHASE_COUNT]; // time spent in each phase since the last reset
+static uint64_t seen_robots(0), seen_pucks(0); // detections over the whole run, to compare runs by
+
+// per-phase times recorded for each thread count during a speedup sweep
+static std::vector<std::vector<double> > sweep_seconds;
+
+// a robot, and the puck it carries, changing matrix cell
+typedef struct
+{
+  unsigned int slot;
+  unsigned int id; // of the robot, which orders the moves
+  int puck; // id of the puck carried, or -1
+  unsigned int from, to; // matrix cells
+} migration_t;
+
+// The matrix is split into one partition of consecutive cells per
+// thread. Migrations found by each worker during the pose phase are
+// queued by the partition that owns the cell being left and the cell
+// being entered, so each partition's cells can then be updated by a
+// single thread without locking.
+static std::vector<std::vector<migration_t> > leaving; // [worker * partitions + partition]
+static std::vector<std::vector<migration_t> > entering; // [worker * partitions + partition]
+static std::vector<std::vector<migration_t> > partition_moves; // scratch space for each partition
+
+static inline unsigned int Partition( unsigned int cell )
+{
+  return( (uint64_t)cell * Pool::threads / (Robot::matrixwidth * Robot::matrixwidth) );
+}
+
+// slots of the robots that asked to pick up or drop a puck during the
+// parallel controller phase, collected by each worker
+static std::vector<std::vector<unsigned int> > actors;
+
+// The priority of a robot's claim on a puck in this update. The high
+// half is a hash of the update and the robot's id, so conflicts go to
+// a different robot each time instead of always the lowest id. The
+// low half is the id, so no two claims tie. Ids rather than slots
+// keep the winner the same however the robots are ordered.
+static inline uint64_t ClaimPriority( unsigned int id )
+{
+  const uint64_t hash( Rng::Mix( (Robot::updates << 32) | id ) );
+  return( (((hash >> 32) | 0x80000000ULL) << 32) | id );
+}
+
+// moves of a puck on its own, relocated after scoring
+static const unsigned int NO_SLOT( ~0u );
+
+static bool MoveOrder( const migration_t& a, const migration_t& b )
+{
+  return( a.id < b.id || (a.id == b.id && a.puck < b.puck) );
+}
+
+// slots in order of the robots' ids
+static bool IdOrder( unsigned int a, unsigned int b )
+{
+  return( Robot::world.id[a] < Robot::world.id[b] );
+}
+
+// Pucks delivered to a home wait score_time updates to score. They
+// are kept in a timing wheel: a ring of lists, indexed by the update
+// in which each puck scores. The ring is longer than score_time, so
+// the list for this update holds only the pucks due now, and pucks
+// can be added and removed in constant time.
+static std::vector<Puck*> wheel_head, wheel_tail;
+
+static inline unsigned int WheelSlot( uint64_t due )
+{
+  return( due & (wheel_head.size() - 1) );
+}
+
+static inline uint64_t DueTime( const Puck* p )
+{
+  return( p->delivery_time + score_time + 1 );
+}
+
+static void WheelInsert( Puck* p )
+{
+  const unsigned int s( WheelSlot( DueTime( p ) ) );
+  p->wheel_prev = wheel_tail[s];
+  p->wheel_next = NULL;
+  if( wheel_tail[s] )
+    wheel_tail[s]->wheel_next = p;
+  else
+    wheel_head[s] = p;
+  wheel_tail[s] = p;
+}
+
+static void WheelRemove( Puck* p )
+{
+  const unsigned int s( WheelSlot( DueTime( p ) ) );
+  if( p->wheel_prev )
+    p->wheel_prev->wheel_next = p->wheel_next;
+  else
+    wheel_head[s] = p->wheel_next;
+  if( p->wheel_next )
+    p->wheel_next->wheel_prev = p->wheel_prev;
+  else
+    wheel_tail[s] = p->wheel_prev;
+  p->wheel_prev = p->wheel_next = NULL;
+}
+
+void Home::WaitingPucks( std::vector<Puck*>& pucks )
+{
+  FOR_EACH( head, wheel_head )
+    for( Puck* p(*head); p; p = p->wheel_next )
+      pucks.push_back( p );
+}
+
+void Home::SetWaitingPucks( const std::vector<Puck*>& pucks )
+{
+  FOR_EACH( head, wheel_head )
+    for( Puck* p(*head); p; )
+      {
+	Puck* next( p->wheel_next );
+	p->wheel_prev = p->wheel_next = NULL;
+	p = next;
+      }
+  std::fill( wheel_head.begin(), wheel_head.end(), (Puck*)NULL );
+  std::fill( wheel_tail.begin(), wheel_tail.end(), (Puck*)NULL );
+
+  FOR_EACH( p, pucks )
+    WheelInsert( *p );
+}
+
+static double Seconds()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return( tv.tv_sec + tv.tv_usec/1e6 );
+}
+
+// the most memory this process has had resident, in kilobytes
+static long PeakRSS()
+{
+  struct rusage usage;
+  getrusage( RUSAGE_SELF, &usage );
+#ifdef __APPLE__
+  return( usage.ru_maxrss / 1024 ); // bytes on OS X
+#else
+  return( usage.ru_maxrss ); // kilobytes on Linux
+#endif
+}
 
 // initialize static members
+bool Robot::headless( !GRAPHICS );
+int64_t Rng::seed(0);
+
 bool Robot::paused( false );
 bool Robot::show_data( false );
 double Robot::fov(  dtor(90.0) );
@@ -30,13 +180,33 @@ double Robot::range( 0.1 );
 double Robot::worldsize(1.0);
 std::vector<Home*> Robot::homes;
 std::vector<Robot*> Robot::population;
+World Robot::world;
 uint64_t Robot::updates(0);
 uint64_t Robot::updates_max( 0.0 ); 
 unsigned int Robot::home_count(1);
 unsigned int Robot::home_population( 20 );
 unsigned int Robot::puck_count(100);
 unsigned int Robot::sleep_msec( 10 );
+unsigned int Robot::threads( sysconf( _SC_NPROCESSORS_ONLN ) );
+unsigned int Robot::sweep_updates( 0 );
+bool Robot::split_sensing( false );
+bool Robot::deferring( false );
+std::vector<Robot::Sensed> Robot::sensed;
+bool Robot::teams( false );
 std::vector<Robot::MatrixCell> Robot::matrix;
+Robot::MatrixCSR Robot::csr;
+Robot::MatrixSparse Robot::sparse;
+double Robot::matrix_budget( 1024.0 * 1024.0 * 1024.0 );
+Robot::matrix_type_t Robot::matrix_type( Robot::MATRIX_CELLS );
+Robot::kernel_type_t Robot::kernel_type( Robot::KERNEL_SCALAR );
+
+// the vector kernel used by the sensors, unless kernel_type is KERNEL_SCALAR
+static unsigned int (*sense_kernel)( const real_t*, const real_t*, unsigned int,
+				     real_t, real_t, real_t,
+				     unsigned int*, real_t*, real_t* )( NULL );
+
+// candidates are passed to the vector kernels this many at a time
+static const unsigned int KERNEL_BLOCK( 64 );
 
 unsigned int Robot::gui_interval(100);
 Robot* Robot::first(NULL);
@@ -54,92 +224,288 @@ const char usage[] = "Antix understands these command line arguments:\n"
   "  -c <int> : sets the number of pixels in the robots' sensor.\n"
   "  -d  Enables drawing the sensor field of view. Speeds things up a bit.\n"
   "  -f <float> : sets the sensor field of view angle in degrees.\n"
+  "  -k <scalar|sse2|avx2> : chooses the sensor code. Defaults to the fastest this CPU supports.\n"
+  "  -m <cells|csr|sparse> : stores the matrix as a vector per cell (the default), as arrays rebuilt every update or as a hash table of the occupied cells.\n"
+#if METRICS
+  "  -M <int> : sets the number of updates between metrics reports (default 10, 0 for none).\n"
+#endif
   "  -g <int> : sets the interval between GUI redraws in milliseconds.\n"
   "  -p <int> : set the size of the robot population.\n"
+  "  -P <int> : runs the controllers in this many separate processes, sharing out the homes. Use the number of homes for one each.\n"
   "  -r <float> : sets the sensor field of view range.\n"
   "  -s <float> : sets the side length of the (square) world.\n"
+  "  -S : senses robots and pucks in separate passes over the sensor cells, instead of one.\n"
+  "  -B : controls the robots of each home together, as a team, instead of one at a time.\n"
+  "  -t <int> : sets the number of threads used to update the world.\n"
+  "  -T <int> : measures per-phase speedup from 1 to -t threads, running this many updates at each, then quits.\n"
   "  -u <int> : sets the number of updates to run before quitting.\n"
   "  -w <int> : sets the initial size of the window, in pixels.\n"
-  "  -z <int> : sets the number of milliseconds to sleep between updates.\n";
+  "  -z <int> : sets the number of milliseconds to sleep between updates.\n"
+  "  --headless : runs without a window, as fast as possible unless -z is given.\n"
+  "  --seed <int> : seeds the random number generator (default 0).\n"
+  "  --checkpoint <file> : writes a checkpoint to this file at the end of the run, and every --checkpoint-interval updates.\n"
+  "  --checkpoint-interval <int> : sets the number of updates between checkpoints (default 0, only at the end).\n"
+  "  --restore <file> : resumes from a checkpoint written by a run with the same options.\n"
+  "  --record <file> : records the robots, pucks and scores to this file for analysis offline.\n"
+  "  --record-interval <int> : sets the number of updates between recorded frames (default 1).\n"
+  "  --replay <file> : plays back a recording instead of simulating. In the window, space pauses, + and - change speed, the arrow keys skip and Home and End go to either end. Headless, it prints a checksum of every frame.\n"
+  "  --dump <prefix> : while replaying, writes every frame shown to <prefix><update>.ppm.\n"
+  "  --dump-size <int> : sets the width and height of those images in pixels (default 700).\n"
+  "  --tiles <int> : splits the world into this many strips, each simulated by its own process. Needs --headless and the default matrix and grid, and leaves out -B, -P, checkpoints and recordings.\n"
+  "  --grid <fixed|auto|hierarchical> : sizes the matrix cells to the sensor range (the default), to suit how crowded the world is, or also splits the crowded cells near homes.\n"
+  "  --grid-interval <int> : sets the number of updates between resizing the matrix (default 100).\n"
+  "  --matrix-budget <float> : sets the most megabytes a dense matrix may take before the sparse one is used instead (default 1024).\n"
+  "  --reorder-interval <int> : sets the number of updates between reordering the robots in memory by where they are (default 0, never). Can't be used with -P or --tiles.\n"
+#if METRICS
+  "  --metrics <file> : writes the metrics reports to this file instead of the console.\n"
+#endif
+  ;
+
+// options that have no single-letter form
+enum { OPT_HEADLESS = 256, OPT_SEED, OPT_METRICS, OPT_CHECKPOINT, OPT_CHECKPOINT_INTERVAL, OPT_RESTORE, OPT_RECORD, OPT_RECORD_INTERVAL, OPT_REPLAY, OPT_DUMP, OPT_DUMP_SIZE, OPT_TILES, OPT_GRID, OPT_GRID_INTERVAL, OPT_MATRIX_BUDGET, OPT_REORDER_INTERVAL };
+
+static const struct option long_options[] = {
+  { "headless", no_argument, NULL, OPT_HEADLESS },
+  { "seed", required_argument, NULL, OPT_SEED },
+  { "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+  { "checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL },
+  { "restore", required_argument, NULL, OPT_RESTORE },
+  { "record", required_argument, NULL, OPT_RECORD },
+  { "record-interval", required_argument, NULL, OPT_RECORD_INTERVAL },
+  { "replay", required_argument, NULL, OPT_REPLAY },
+  { "dump", required_argument, NULL, OPT_DUMP },
+  { "dump-size", required_argument, NULL, OPT_DUMP_SIZE },
+  { "tiles", required_argument, NULL, OPT_TILES },
+  { "grid", required_argument, NULL, OPT_GRID },
+  { "grid-interval", required_argument, NULL, OPT_GRID_INTERVAL },
+  { "matrix-budget", required_argument, NULL, OPT_MATRIX_BUDGET },
+  { "reorder-interval", required_argument, NULL, OPT_REORDER_INTERVAL },
+#if METRICS
+  { "metrics", required_argument, NULL, OPT_METRICS },
+#endif
+  { NULL, 0, NULL, 0 }
+};
 
 Home::Home( unsigned int id, const Color& color, double x, double y, double r ) 
-  : id(id), color(color), pucks(), score(0), x(x), y(y), r(r) 
+  : id(id), color(color), pucks(0), score(0), x(x), y(y), r(r), team(NULL)
 {
   Robot::homes.push_back(this);
 }
 
 
+void World::Reserve( unsigned int robots, unsigned int puck_count )
+{
+  x.reserve( robots );
+  y.reserve( robots );
+  a.reserve( robots );
+  v.reserve( robots );
+  w.reserve( robots );
+  home_id.reserve( robots );
+  held_puck.reserve( robots );
+  claim.reserve( robots );
+  dropping.reserve( robots );
+  cell.reserve( robots );
+  cell_pos.reserve( robots );
+  sensor_bbox.reserve( robots );
+  handle.reserve( robots );
+  id.reserve( robots );
+  pucks.reserve( puck_count );
+}
+
+void World::Resize( unsigned int robots )
+{
+  x.resize( robots );
+  y.resize( robots );
+  a.resize( robots );
+  v.resize( robots );
+  w.resize( robots );
+  home_id.resize( robots );
+  held_puck.resize( robots );
+  claim.resize( robots );
+  dropping.resize( robots );
+  cell.resize( robots );
+  cell_pos.resize( robots );
+  sensor_bbox.resize( robots );
+  handle.resize( robots );
+  id.resize( robots );
+}
+
+unsigned int World::AddRobot( Robot* r, unsigned int hid, double px, double py, double pa )
+{
+  x.push_back( px );
+  y.push_back( py );
+  a.push_back( pa );
+  v.push_back( 0.0 );
+  w.push_back( 0.0 );
+  home_id.push_back( hid );
+  held_puck.push_back( -1 );
+  claim.push_back( -1 );
+  dropping.push_back( false );
+  cell.push_back( 0 );
+  cell_pos.push_back( 0 );
+  sensor_bbox.push_back( bbox_t() );
+  id.push_back( handle.size() );
+  handle.push_back( r );
+  return handle.size() - 1;
+}
+
+unsigned int World::AddPuck( Puck* p )
+{
+  pucks.push_back( p );
+  return pucks.size() - 1;
+}
+
 Robot::Robot( Home* home,
 	      const Pose& pose )
-  : index(0),
+  : slot( world.AddRobot( this, home->id, pose.x, pose.y, pose.a ) ),
     home(home),
     pose(pose),
     speed(),
     see_robots(),
-    see_pucks(),
-    puck_held(NULL)
+    see_pucks()
 {
+  // the world refers to homes by their index
+  assert( homes[home->id] == home );
+
   // add myself to the static vector of all robots
   population.push_back( this );
+
+  // each robot has its own random number stream, keyed by its slot
+  rng_key = Rng::Key( Rng::STREAM_ROBOT, slot );
+  rng_update = Rng::SETUP;
+  rng_draws = 0;
   
   if( ! first )
     first = this;
 }
 
-// wrapper requred to work around C++'s inability to use methods as callbacks 
-static void PuckWorkerFunc( Robot* r )
-{
-  r->UpdatePuckSensor();
-}
-
-static void RobotWorkerFunc( Robot* r )
+void Robot::CommitHandles()
 {
-  r->UpdateRobotSensor();
-}
-
-void* WorkerThreadEntry( void (*func)(Robot*) )
-{
-  pthread_mutex_lock(&sync_mutex);  
-  
-  // wait for signal
-  while(true)
+  for( unsigned int i(world.committed); i<world.RobotCount(); i++ )
     {
-      // wait for the main thread to wake us up
-      //printf( "worker %p sleeping\n", func );
-      pthread_cond_wait( &cond_start, &sync_mutex );
-      //printf( "worker %p waking\n", func );
-      pthread_mutex_unlock( &sync_mutex );
+      const Robot* r( world.handle[i] );
       
-      // call func for every robot 
-      FOR_EACH( it, Robot::population )
-	(*func)(*it);
+      world.x[i] = r->pose.x;
+      world.y[i] = r->pose.y;
+      world.a[i] = r->pose.a;
+      world.v[i] = r->speed.v;
+      world.w[i] = r->speed.w;
       
-      // signal done
-      pthread_mutex_lock( &sync_mutex );	  
-      
-      // decrement the thread count. if we're the last thread done, signal the main thread
-      if( --(worker_count) == 0 )
-	{
-	  //printf( "last worker (%p) signalling main thread\n", func );
-	  pthread_cond_signal( &cond_done );
-	}
-      // keep lock going round the loop
+      world.cell[i] = Cell( world.x[i], world.y[i] );
+      if( matrix_type != MATRIX_CSR )
+	CellAt( world.cell[i] ).AddRobot( i );
+
+      FovBBox( world.x[i], world.y[i], world.a[i], world.sensor_bbox[i] );
     }
 
-  return NULL; // compiler satisfaction
+  world.committed = world.RobotCount();
 }
 
 void Robot::Init( int argc, char** argv )
 {
-  // seed the random number generator with the current time
-  //srand48(time(NULL));
-  srand48(0); // for debugging - start the same every time
-	
+  init_seconds = Seconds();
+
+  kernel_type = HaveAVX2() ? KERNEL_AVX2 : HaveSSE2() ? KERNEL_SSE2 : KERNEL_SCALAR;
+
+  bool sleep_given( false );
+  long int seed(0); // for debugging - start the same every time
+#if METRICS
+  const char* metrics_file( NULL );
+#endif
+
   // parse arguments to configure Robot static members
   int c;
-  while( ( c = getopt( argc, argv, "?dh:a:p:s:f:g:r:c:u:z:w:")) != -1 )
+  while( ( c = getopt_long( argc, argv, "?dh:a:Bp:P:s:Sf:g:k:m:M:r:c:t:T:u:z:w:", long_options, NULL )) != -1 )
     switch( c )
       {
+      case OPT_HEADLESS:
+	headless = true;
+	puts( "[Antix] headless" );
+	break;
+
+      case OPT_SEED:
+	seed = atol( optarg );
+	printf( "[Antix] seed: %ld\n", seed );
+	break;
+
+      case OPT_CHECKPOINT:
+	Checkpoint::filename = optarg;
+	printf( "[Antix] checkpoint: %s\n", Checkpoint::filename );
+	break;
+
+      case OPT_CHECKPOINT_INTERVAL:
+	Checkpoint::interval = atoi( optarg );
+	printf( "[Antix] checkpoint interval: %u\n", Checkpoint::interval );
+	break;
+
+      case OPT_RESTORE:
+	Checkpoint::restore_filename = optarg;
+	printf( "[Antix] restore: %s\n", Checkpoint::restore_filename );
+	break;
+
+      case OPT_RECORD:
+	Recorder::filename = optarg;
+	printf( "[Antix] record: %s\n", Recorder::filename );
+	break;
+
+      case OPT_RECORD_INTERVAL:
+	Recorder::interval = std::max( 1, atoi( optarg ) );
+	printf( "[Antix] record interval: %u\n", Recorder::interval );
+	break;
+
+      case OPT_REPLAY:
+	Replay::filename = optarg;
+	printf( "[Antix] replay: %s\n", Replay::filename );
+	break;
+
+      case OPT_DUMP:
+	Replay::dump_prefix = optarg;
+	printf( "[Antix] dump: %s\n", Replay::dump_prefix );
+	break;
+
+      case OPT_DUMP_SIZE:
+	Replay::dump_size = std::max( 1, atoi( optarg ) );
+	printf( "[Antix] dump size: %u\n", Replay::dump_size );
+	break;
+
+      case OPT_TILES:
+	Tiles::count = atoi( optarg );
+	if( Tiles::count < 2 )
+	  Tiles::count = 0; // one tile is the whole world
+	printf( "[Antix] tiles: %u\n", std::max( 1u, Tiles::count ) );
+	break;
+
+      case OPT_GRID:
+	if( strcmp( optarg, "fixed" ) == 0 )
+	  grid_type = GRID_FIXED;
+	else if( strcmp( optarg, "auto" ) == 0 )
+	  grid_type = GRID_AUTO;
+	else if( strcmp( optarg, "hierarchical" ) == 0 )
+	  grid_type = GRID_HIERARCHICAL;
+	else
+	  {
+	    fprintf( stderr, "[Antix] Unknown grid type \"%s\".\n", optarg );
+	    puts( usage );
+	    exit(-1); // error
+	  }
+	printf( "[Antix] grid: %s\n", optarg );
+	break;
+
+      case OPT_GRID_INTERVAL:
+	grid_interval = std::max( 1, atoi( optarg ) );
+	printf( "[Antix] grid interval: %u\n", grid_interval );
+	break;
+
+      case OPT_REORDER_INTERVAL:
+	reorder_interval = atoi( optarg );
+	printf( "[Antix] reorder interval: %u\n", reorder_interval );
+	break;
+
+      case OPT_MATRIX_BUDGET:
+	matrix_budget = atof( optarg ) * 1024.0 * 1024.0;
+	printf( "[Antix] matrix budget: %.0f MB\n", matrix_budget / (1024.0 * 1024.0) );
+	break;
+
       case 'h':
 	home_count = atoi( optarg );
 	printf( "[Antix] home count: %d\n", home_count );
@@ -150,16 +516,31 @@ void Robot::Init( int argc, char** argv )
 	printf( "[Antix] puck count: %d\n", puck_count );
 	break;
 			  
+      case 'B':
+	teams = true;
+	puts( "[Antix] team controllers" );
+	break;
+			  
       case 'p': 
 	home_population = atoi( optarg );
 	printf( "[Antix] home_population: %d\n", home_population );
 	break;
 				
+      case 'P': 
+	Remote::processes = atoi( optarg );
+	printf( "[Antix] controller processes: %u\n", Remote::processes );
+	break;
+				
       case 's': 
 	worldsize = atof( optarg );
 	printf( "[Antix] worldsize: %.2f\n", worldsize );
 	break;
 				
+      case 'S':
+	split_sensing = true;
+	puts( "[Antix] split sensing" );
+	break;
+				
       case 'f': 
 	fov = dtor(atof( optarg )); // degrees to radians
 	printf( "[Antix] fov: %.2f\n", fov );
@@ -170,11 +551,53 @@ void Robot::Init( int argc, char** argv )
 	printf( "[Antix] gui_interval: %lu\n", (long unsigned)gui_interval );
 	break;
 
+      case 'k':
+	if( strcmp( optarg, "scalar" ) == 0 )
+	  kernel_type = KERNEL_SCALAR;
+	else if( strcmp( optarg, "sse2" ) == 0 && HaveSSE2() )
+	  kernel_type = KERNEL_SSE2;
+	else if( strcmp( optarg, "avx2" ) == 0 && HaveAVX2() )
+	  kernel_type = KERNEL_AVX2;
+	else
+	  {
+	    fprintf( stderr, "[Antix] Sensor kernel \"%s\" is not available.\n", optarg );
+	    puts( usage );
+	    exit(-1); // error
+	  }
+	printf( "[Antix] kernel: %s\n", optarg );
+	break;
+
+      case 'm':
+	if( strcmp( optarg, "cells" ) == 0 )
+	  matrix_type = MATRIX_CELLS;
+	else if( strcmp( optarg, "csr" ) == 0 )
+	  matrix_type = MATRIX_CSR;
+	else if( strcmp( optarg, "sparse" ) == 0 )
+	  matrix_type = MATRIX_SPARSE;
+	else
+	  {
+	    fprintf( stderr, "[Antix] Unknown matrix type \"%s\".\n", optarg );
+	    puts( usage );
+	    exit(-1); // error
+	  }
+	printf( "[Antix] matrix: %s\n", optarg );
+	break;
+
       case 'r': 
 	range = atof( optarg );
 	printf( "[Antix] range: %.2f\n", range );
 	break;
 								
+      case 't':
+	threads = atoi( optarg );
+	printf( "[Antix] threads: %u\n", threads );
+	break;
+
+      case 'T':
+	sweep_updates = atoi( optarg );
+	printf( "[Antix] sweep_updates: %u\n", sweep_updates );
+	break;
+								
       case 'u':
 	updates_max = atol( optarg );
 	printf( "[Antix] updates_max: %lu\n", (long unsigned)updates_max );
@@ -182,9 +605,22 @@ void Robot::Init( int argc, char** argv )
 				
       case 'z':
 	sleep_msec = atoi( optarg );
+	sleep_given = true;
 	printf( "[Antix] sleep_msec: %d\n", sleep_msec );
 	break;
 				
+#if METRICS
+      case 'M':
+	Metrics::interval = atoi( optarg );
+	printf( "[Antix] metrics interval: %u\n", Metrics::interval );
+	break;
+
+      case OPT_METRICS:
+	metrics_file = optarg;
+	printf( "[Antix] metrics file: %s\n", metrics_file );
+	break;
+#endif
+
 #if GRAPHICS
       case 'w': winsize = atoi( optarg );
 	printf( "[Antix] winsize: %d\n", winsize );
@@ -205,114 +641,296 @@ void Robot::Init( int argc, char** argv )
 	exit(-1); // error
       }
 
+  // controllers in other processes keep their state out of reach
+  if( Checkpoint::filename && Remote::processes )
+    {
+      fprintf( stderr, "[Antix] Checkpoints need the controllers in the simulator, so can't be used with -P.\n" );
+      puts( usage );
+      exit(-1); // error
+    }
+
+  // a replay's world is the size of the recording's
+  if( Replay::filename )
+    Replay::Open();
+
   Robot::matrixwidth = floor( Robot::worldsize / Robot::range );
-  Robot::matrix.resize( Robot::matrixwidth * Robot::matrixwidth );
+
+  // cells are numbered by an unsigned int
+  if( Robot::matrixwidth > 65535 )
+    {
+      fprintf( stderr, "[Antix] The matrix would be %u cells wide, too wide to number its cells.\n",
+	       Robot::matrixwidth );
+      puts( usage );
+      exit(-1); // error
+    }
+
+  // a huge world that is mostly empty is stored sparsely
+  if( DenseMatrixBytes( Robot::matrixwidth ) > matrix_budget )
+    {
+      printf( "[Antix] a dense matrix %u cells wide would take %.0f MB, so storing it sparsely\n",
+	      Robot::matrixwidth, DenseMatrixBytes( Robot::matrixwidth ) / (1024.0 * 1024.0) );
+      matrix_type = MATRIX_SPARSE;
+    }
+
+  // the tiles swap cells between processes, with controllers in each,
+  // so they keep to the simplest setup
+  if( Tiles::count &&
+      ( ! headless || matrix_type != MATRIX_CELLS || grid_type != GRID_FIXED || teams || Remote::processes ||
+	Checkpoint::filename || Checkpoint::restore_filename || Recorder::filename || Replay::filename ) )
+    {
+      fprintf( stderr, "[Antix] Tiles need --headless, -m cells and --grid fixed, and can't be used with -B, -P, checkpoints or recordings.\n" );
+      puts( usage );
+      exit(-1); // error
+    }
+
+  // controller processes and tiles keep the robots' slots from the start
+  if( reorder_interval && (Tiles::count || Remote::processes) )
+    {
+      fprintf( stderr, "[Antix] Reordering can't be used with -P or --tiles.\n" );
+      puts( usage );
+      exit(-1); // error
+    }
+
+  // each tile needs two columns of its own, so its neighbours' edge
+  // columns never meet
+  if( Tiles::count && Robot::matrixwidth < 2 * Tiles::count )
+    {
+      fprintf( stderr, "[Antix] The matrix is %u cells wide, too narrow for %u tiles.\n",
+	       Robot::matrixwidth, Tiles::count );
+      puts( usage );
+      exit(-1); // error
+    }
+
+  if( matrix_type == MATRIX_CELLS )
+    Robot::matrix.resize( Robot::matrixwidth * Robot::matrixwidth );
+
+  world.Reserve( home_count * home_population, puck_count );
+
+  // big enough that a puck is never due a whole turn of the wheel away
+  unsigned int wheel_size(1);
+  while( wheel_size <= score_time + 1 )
+    wheel_size *= 2;
+  wheel_head.resize( wheel_size );
+  wheel_tail.resize( wheel_size );
+
+  if( kernel_type == KERNEL_AVX2 )
+    sense_kernel = SenseKernelAVX2;
+  else if( kernel_type == KERNEL_SSE2 )
+    sense_kernel = SenseKernelSSE2;
+  	
+  // seed the random number streams
+  Rng::seed = seed;
+
+  // there's nobody watching, so don't slow down unless asked to
+  if( headless && ! sleep_given )
+    sleep_msec = 0;
   	
 #if GRAPHICS
-  InitGraphics( argc, argv );
+  if( ! headless )
+    InitGraphics( argc, argv );
 #endif // GRAPHICS
   
-  pthread_mutex_init( &sync_mutex, NULL );
-  pthread_cond_init( &cond_start, NULL );
-  pthread_cond_init( &cond_done, NULL );
-  
-  // enter worker threads - they do nothing until signalled in UpdateAll()
-  pthread_t pt;
-  pthread_create( &pt, NULL, (void*(*)(void*))WorkerThreadEntry, (void*)RobotWorkerFunc );
-  pthread_create( &pt, NULL, (void*(*)(void*))WorkerThreadEntry, (void*)PuckWorkerFunc );
+  // start the worker threads - they do nothing until given work in UpdateAll()
+  Pool::Init( threads );
+
+#if METRICS
+  Metrics::Init( Pool::threads, metrics_file );
+#endif
+
+  if( matrix_type == MATRIX_SPARSE )
+    sparse.partitions.resize( Pool::threads );
+
+  leaving.resize( Pool::threads * Pool::threads );
+  entering.resize( Pool::threads * Pool::threads );
+  partition_moves.resize( Pool::threads );
+  actors.resize( Pool::threads );
+  sensed.resize( Pool::threads );
+
+  // a sweep starts with one thread and adds one at each step
+  if( sweep_updates )
+    Pool::active = 1;
   
   // record the starting time to measure how long we have run for
-  struct timeval tv;
-  gettimeofday( &tv, NULL );
-  start_seconds = tv.tv_sec + tv.tv_usec/1e6;
+  start_seconds = Seconds();
 }
 
-void Robot::TestRobotsInCell( const MatrixCell& cell )
+void Robot::TestRobotsInSpan( unsigned int slot, const Span& span, std::vector<SeeRobot>& out )
 {
   // test squared ranges to avoid expensive sqrt()
-  double rngsqrd( range * range );
+  const real_t rngsqrd( range * range );
+  const real_t rng( range );
+  const real_t halffov( fov/2.0 );
+
+  const real_t x( world.x[slot] );
+  const real_t y( world.y[slot] );
+  const real_t a( world.a[slot] );
+#if DEBUGVIS
+  Robot* self( world.handle[slot] );
+#endif
 
-  FOR_EACH( it, cell.robots )
+  const unsigned int* begin( span.robots_begin );
+  const unsigned int* end( span.robots_end );
+
+  if( sense_kernel )
     {
-      Robot* other( *it );
+      // gather the other robots' positions into blocks for the vector kernel
+      unsigned int ids[KERNEL_BLOCK], found[KERNEL_BLOCK];
+      real_t cx[KERNEL_BLOCK], cy[KERNEL_BLOCK], ranges[KERNEL_BLOCK], bearings[KERNEL_BLOCK];
+
+      for( const unsigned int* it(begin); it != end; )
+	{
+	  unsigned int n(0);
+	  for( ; it != end && n < KERNEL_BLOCK; it++ )
+	    if( *it != slot )
+	      {
+#if DEBUGVIS
+		self->neighbors.push_back( world.handle[*it] );
+#endif
+		ids[n] = *it;
+		cx[n] = world.x[*it];
+		cy[n] = world.y[*it];
+		n++;
+	      }
+
+	  for( unsigned int k(n); k < KERNEL_BLOCK && k % KERNEL_PAD; k++ )
+	    cx[k] = cy[k] = 0.0; // padding
+
+	  const unsigned int seen( (*sense_kernel)( cx, cy, n, x, y, a, found, ranges, bearings ) );
+	  for( unsigned int s(0); s<seen; s++ )
+	    {
+	      const unsigned int other( ids[found[s]] );
+	      out.push_back( SeeRobot( other, ranges[s], bearings[s], world.held_puck[other] >= 0 ) );
+	    }
+	}
+      return;
+    }
+
+  for( const unsigned int* it(begin); it != end; it++ )
+    {
+      const unsigned int other( *it );
       
       // discard if it's the same robot
-      if( other == this )
+      if( other == slot )
 	continue;
 		
 #if DEBUGVIS
-      neighbors.push_back( other );
+      self->neighbors.push_back( world.handle[other] );
 #endif
 			
       // discard if it's out of range. We put off computing the
       // hypotenuse as long as we can, as it's relatively expensive.
 			
-      const double dx( WrapDistance( other->pose.x - pose.x ) );
-      if( fabs(dx) > Robot::range )
+      const real_t dx( WrapDistance( world.x[other] - x ) );
+      if( fabs(dx) > rng )
 	continue; // out of range
 			
-      const double dy( WrapDistance( other->pose.y - pose.y ) );		
-      if( fabs(dy) > Robot::range )
+      const real_t dy( WrapDistance( world.y[other] - y ) );		
+      if( fabs(dy) > rng )
 	continue; // out of range
       
       // test distance squared
-      const double dsq( dx*dx + dy*dy );
+      const real_t dsq( dx*dx + dy*dy );
       if( dsq > rngsqrd ) 
 	continue; 
 			
       // discard if it's out of field of view 
-      const double absolute_heading( fast_atan2( dy, dx ) );
-      const double relative_heading( AngleNormalize((absolute_heading - pose.a) ));
-      if( fabs(relative_heading) > fov/2.0   ) 
+      const real_t absolute_heading( fast_atan2( dy, dx ) );
+      const real_t relative_heading( AngleNormalize((absolute_heading - a) ));
+      if( fabs(relative_heading) > halffov   ) 
 	continue; 
 			
-      see_robots.push_back( SeeRobot( other->home,
-				      other->pose, 
-				      other->speed, 
-				      sqrt( dsq ), 
-				      relative_heading,
-				      other->Holding() ) );						
+      out.push_back( SeeRobot( other, 
+			       sqrt( dsq ), 
+			       relative_heading,
+			       world.held_puck[other] >= 0 ) );
     }
 }	
 
-void Robot::TestPucksInCell( const MatrixCell& cell )
+void Robot::TestPucksInSpan( unsigned int slot, const Span& span, std::vector<SeePuck>& out )
 {
   // test squared ranges to avoid expensive sqrt()
-  double rngsqrd( range * range );
+  const real_t rngsqrd( range * range );
+  const real_t rng( range );
+  const real_t halffov( fov/2.0 );
+
+  const real_t x( world.x[slot] );
+  const real_t y( world.y[slot] );
+  const real_t a( world.a[slot] );
+#if DEBUGVIS
+  Robot* self( world.handle[slot] );
+#endif
+
+  const unsigned int* begin( span.pucks_begin );
+  const unsigned int* end( span.pucks_end );
+
+  if( sense_kernel )
+    {
+      // gather the pucks' positions into blocks for the vector kernel
+      Puck* candidates[KERNEL_BLOCK];
+      unsigned int found[KERNEL_BLOCK];
+      real_t cx[KERNEL_BLOCK], cy[KERNEL_BLOCK], ranges[KERNEL_BLOCK], bearings[KERNEL_BLOCK];
+
+      for( const unsigned int* it(begin); it != end; )
+	{
+	  unsigned int n(0);
+	  for( ; it != end && n < KERNEL_BLOCK; it++ )
+	    {
+	      Puck* puck( world.pucks[*it] );
+#if DEBUGVIS
+	      self->neighbor_pucks.push_back( puck );
+#endif
+	      candidates[n] = puck;
+	      cx[n] = puck->x;
+	      cy[n] = puck->y;
+	      n++;
+	    }
+
+	  for( unsigned int k(n); k < KERNEL_BLOCK && k % KERNEL_PAD; k++ )
+	    cx[k] = cy[k] = 0.0; // padding
+
+	  const unsigned int seen( (*sense_kernel)( cx, cy, n, x, y, a, found, ranges, bearings ) );
+	  for( unsigned int s(0); s<seen; s++ )
+	    {
+	      Puck* puck( candidates[found[s]] );
+	      out.push_back( SeePuck( puck->id, ranges[s], bearings[s], puck->held ) );
+	    }
+	}
+      return;
+    }
   
-  FOR_EACH( it, cell.pucks )
+  for( const unsigned int* it(begin); it != end; it++ )
     {      
-      Puck* puck( *it );
+      Puck* puck( world.pucks[*it] );
 		
 #if DEBUGVIS
-      neighbor_pucks.push_back( puck );
+      self->neighbor_pucks.push_back( puck );
 #endif
       // discard if it's out of range. We put off computing the
       // hypotenuse as long as we can, as it's relatively expensive.
 		
-      const double dx( WrapDistance( puck->x - pose.x ) );
-      if( fabs(dx) > Robot::range )
+      const real_t dx( WrapDistance( puck->x - x ) );
+      if( fabs(dx) > rng )
 	continue; // out of range
 		
-      const double dy( WrapDistance( puck->y - pose.y ) );		
-      if( fabs(dy) > Robot::range )
+      const real_t dy( WrapDistance( puck->y - y ) );		
+      if( fabs(dy) > rng )
 	continue; // out of range
 		
-      const double dsq( dx*dx + dy*dy );
+      const real_t dsq( dx*dx + dy*dy );
       if( dsq > rngsqrd ) 
 	continue; 
 			
       // discard if it's out of field of view 
-      const double absolute_heading( fast_atan2( dy, dx ) );
-      const double relative_heading( AngleNormalize((absolute_heading - pose.a)));
-      if( fabs(relative_heading) > fov/2.0   ) 
+      const real_t absolute_heading( fast_atan2( dy, dx ) );
+      const real_t relative_heading( AngleNormalize((absolute_heading - a)));
+      if( fabs(relative_heading) > halffov   ) 
 	continue; 
 		
       // passes all the tests, so we record a puck detection in the
       // vector
-      see_pucks.push_back( SeePuck( puck, sqrt(dsq), 
-				    relative_heading,
-				    puck->held));
+      out.push_back( SeePuck( puck->id, sqrt(dsq), 
+			      relative_heading,
+			      puck->held));
     }		
 }
 
@@ -326,139 +944,474 @@ void Robot::TestPucksInCell( const MatrixCell& cell )
 //   // signal done
 // }
 
-void Robot::UpdateRobotSensor()
+void Robot::UpdateRobotSensor( unsigned int slot, unsigned int worker )
 {
-  see_robots.clear();
-  
-  const int lastx( CellNoWrap(sensor_bbox.x.max) );
-  const int lasty( CellNoWrap(sensor_bbox.y.max) );
+  std::vector<SeeRobot>& out( sensed[worker].robots );
+  const unsigned int first( out.size() );
   
-  for( int x(CellNoWrap(sensor_bbox.x.min)); x<=lastx; x++ )
-    for( int y(CellNoWrap(sensor_bbox.y.min)); y<=lasty; y++ )
-      TestRobotsInCell( matrix[ CellWrap(x) + ( CellWrap(y) * matrixwidth )] );
+  std::vector<Span>& spans( sensed[worker].spans );
+  QuerySpans( world.sensor_bbox[slot], spans );
+  FOR_EACH( it, spans )
+    TestRobotsInSpan( slot, *it, out );
+
+  world.handle[slot]->see_robots = SenseView<SeeRobot>( out, first, out.size() );
 }
 
-void Robot::UpdatePuckSensor()
+void Robot::UpdatePuckSensor( unsigned int slot, unsigned int worker )
 {
-  see_pucks.clear();
+  std::vector<SeePuck>& out( sensed[worker].pucks );
+  const unsigned int first( out.size() );
   
-  // note: the following two large sensing operations could safely be
-  // done in parallel since they do not modify any common data
+  std::vector<Span>& spans( sensed[worker].spans );
+  QuerySpans( world.sensor_bbox[slot], spans );
+  FOR_EACH( it, spans )
+    TestPucksInSpan( slot, *it, out );
 
-  const int lastx( CellNoWrap(sensor_bbox.x.max) );
-  const int lasty( CellNoWrap(sensor_bbox.y.max) );
-  
-  for( int x(CellNoWrap(sensor_bbox.x.min)); x<=lastx; x++ )
-    for( int y(CellNoWrap(sensor_bbox.y.min)); y<=lasty; y++ )
-      TestPucksInCell( matrix[ CellWrap(x) + ( CellWrap(y) * matrixwidth ) ] );
+  world.handle[slot]->see_pucks = SenseView<SeePuck>( out, first, out.size() );
 }
 
 
-/*
-void Robot::UpdateSensors()
+void Robot::UpdateSensors( unsigned int slot, unsigned int worker )
 {
-  see_robots.clear();
-  see_pucks.clear();
+  Robot* self( world.handle[slot] );
+  std::vector<SeeRobot>& robots_out( sensed[worker].robots );
+  std::vector<SeePuck>& pucks_out( sensed[worker].pucks );
+  const unsigned int first_robot( robots_out.size() );
+  const unsigned int first_puck( pucks_out.size() );
   
-  // note: the following two large sensing operations could safely be
-  // done in parallel since they do not modify any common data
-
 #if DEBUGVIS
   // debug visualization  
-  neighbors.clear();
-  neighbor_pucks.clear();
-  neighbor_cells.clear();
+  self->neighbors.clear();
+  self->neighbor_pucks.clear();
+  self->neighbor_cells.clear();
 #endif  
   
-  const int lastx( CellNoWrap(sensor_bbox.x.max) );
-  const int lasty( CellNoWrap(sensor_bbox.y.max) );
-  
-  for( int x(CellNoWrap(sensor_bbox.x.min)); x<=lastx; x++ )
-    for( int y(CellNoWrap(sensor_bbox.y.min)); y<=lasty; y++ )
-      {
-	unsigned int index( CellWrap(x) + ( CellWrap(y) * matrixwidth ));
-	TestRobotsInCell( matrix[index] );
-	TestPucksInCell( matrix[index] );
-	
+  // visit each cell once for both sensors, so it is only pulled into
+  // cache once
+  std::vector<Span>& spans( sensed[worker].spans );
+  QuerySpans( world.sensor_bbox[slot], spans );
+  FOR_EACH( it, spans )
+    {
+      TestRobotsInSpan( slot, *it, robots_out );
+      TestPucksInSpan( slot, *it, pucks_out );
 #if DEBUGVIS		
-	neighbor_cells.insert( index );
+      self->neighbor_cells.insert( it->cell );
 #endif
-      }
+    }
+
+  self->see_robots = SenseView<SeeRobot>( robots_out, first_robot, robots_out.size() );
+  self->see_pucks = SenseView<SeePuck>( pucks_out, first_puck, pucks_out.size() );
 }
-*/
 
 bool Robot::Pickup()
 {
-  if( ! puck_held ) 
-    FOR_EACH( it, see_pucks )
-      {
-	// is the puck close enough and is it not held already?
-	if( (it->range < pickup_range) && !it->puck->held)
-	  {				
-	    // pick it up
-	    puck_held = it->puck;
-	    puck_held->Pickup();
-	    return true;
-	  }		  		  
-      }
-	
-  // already holding or nothing close enough
-  return false; 
+  if( world.held_puck[slot] >= 0 )
+    return false; // already holding
+
+  // Take the closest puck within reach that isn't held, and of those
+  // equally close the lowest id. The sensors may list pucks in any
+  // order, depending on how the matrix is sized, so the choice must
+  // not depend on it.
+  Puck* puck( NULL );
+  double closest( pickup_range );
+  FOR_EACH( it, see_pucks )
+    {
+      Puck* p( it->GetPuck() );
+      if( (it->range < closest || (puck && it->range == closest && p->id < puck->id)) &&
+	  !p->held && Tiles::SimulatesPuck( p->id ) )
+	{
+	  puck = p;
+	  closest = it->range;
+	}
+    }
+
+  if( puck == NULL )
+    return false; // nothing close enough
+
+  // A controller process only asks the simulator to pick it up, which
+  // settles competing requests. Marking the puck held here would hide
+  // it from the robots of the homes this process runs later, but not
+  // from those of other processes, so who competed for it would
+  // depend on how the homes were split between processes.
+  if( Remote::child )
+    {
+      Remote::IntendPickup( puck->id );
+      return true;
+    }
+
+  // in parallel, stake a claim that is settled afterwards
+  if( deferring )
+    {
+      ClaimPuck( puck );
+      return true;
+    }
+
+  return PickupPuck( puck );
+}
+
+void Robot::ClaimPuck( Puck* puck )
+{
+  // the claim word is only ever swapped, never read plainly, since
+  // other threads swap it too. Start from a guess of no claim and
+  // retry with whatever was there instead, until ours is in or a
+  // stronger one is.
+  const uint64_t priority( ClaimPriority( world.id[slot] ) );
+  uint64_t old(0), seen;
+  while( old < priority &&
+	 (seen = __sync_val_compare_and_swap( &puck->claim, old, priority )) != old )
+    old = seen;
+
+  world.claim[slot] = puck->id;
+}
+
+void Robot::Request( bool drop, Puck* puck )
+{
+  if( drop && world.held_puck[slot] >= 0 )
+    world.dropping[slot] = true;
+  if( puck )
+    ClaimPuck( puck );
+
+  if( world.claim[slot] >= 0 || world.dropping[slot] )
+    actors[0].push_back( slot );
+}
+
+bool Robot::PickupPuck( Puck* puck )
+{
+  if( world.held_puck[slot] >= 0 || puck->held )
+    return false;
+
+  world.held_puck[slot] = puck->id;
+  puck->Pickup();
+  
+  // a carried puck lives in its robot's matrix cell, so they can
+  // change cell together
+  const unsigned int cell( world.cell[slot] );
+  if( matrix_type != MATRIX_CSR && puck->index != cell )
+    {
+      CellAt( puck->index ).RemovePuck( puck->id );
+      ReleaseCell( puck->index );
+      CellAt( cell ).AddPuck( puck->id );
+      puck->index = cell;
+    }
+  return true;
+}
+
+void Robot::Save( std::vector<char>& out ) const
+{
+  Checkpoint::Put( out, speed );
+  SaveState( out );
+}
+
+void Robot::Load( const char*& in )
+{
+  Checkpoint::Get( in, speed );
+  LoadState( in );
 }
 
 bool Robot::Holding() const
 {
-  return (bool)puck_held;
+  return( world.held_puck[slot] >= 0 );
 }
 
 bool Robot::Drop()
 {
-  if( puck_held )
+  const int held( world.held_puck[slot] );
+  if( held >= 0 && deferring )
+    {
+      // dropped afterwards, when it is safe to change the home
+      world.dropping[slot] = true;
+      return true;
+    }
+
+  if( held >= 0 )
     {
-      puck_held->Drop();
-      puck_held = NULL;		
+      if( Remote::child ) // a controller process asks the simulator to drop it
+	Remote::IntendDrop();
+      else
+	world.pucks[held]->Drop();
+      world.held_puck[slot] = -1;		
       return true; // dropped successfully
     }
   return false; // nothing to drop  
 }
 
 
-void Robot::UpdatePose()
+void Robot::UpdatePose( unsigned int slot )
 {
+  real_t& x( world.x[slot] );
+  real_t& y( world.y[slot] );
+  real_t& a( world.a[slot] );
+
   // move according to the current speed 
-  const double dx( speed.v * fast_cos(pose.a) );
-  const double dy( speed.v * fast_sin(pose.a) ); 
-  const double da( speed.w );
+  const real_t dx( world.v[slot] * fast_cos(a) );
+  const real_t dy( world.v[slot] * fast_sin(a) ); 
+  const real_t da( world.w[slot] );
   
-  pose.x = DistanceNormalize( pose.x + dx );
-  pose.y = DistanceNormalize( pose.y + dy );
-  pose.a = AngleNormalize( pose.a + da );
+  x = DistanceNormalize( x + dx );
+  y = DistanceNormalize( y + dy );
+  a = AngleNormalize( a + da );
     
-  const unsigned int newindex( Cell( pose.x, pose.y ) );
- 
   // if we're carrying a puck, update it's position
-  if( puck_held )
+  const int held( world.held_puck[slot] );
+  if( held >= 0 )
+    {
+      world.pucks[held]->x = x;
+      world.pucks[held]->y = y;
+    }
+
+  // compute the new bounding box of the fov
+  FovBBox( x, y, a, world.sensor_bbox[slot] );
+}
+
+void Robot::MatrixCell::AddRobot( unsigned int slot )
+{
+  world.cell_pos[slot] = robots.size();
+  robots.push_back( slot );
+}
+
+void Robot::MatrixCell::RemoveRobot( unsigned int slot )
+{
+  const unsigned int pos( world.cell_pos[slot] );
+  const unsigned int last( robots.back() );
+  robots[pos] = last;
+  world.cell_pos[last] = pos;
+  robots.pop_back();
+}
+
+void Robot::MatrixCell::AddPuck( unsigned int id )
+{
+  world.pucks[id]->cell_pos = pucks.size();
+  pucks.push_back( id );
+}
+
+void Robot::MatrixCell::RemovePuck( unsigned int id )
+{
+  const unsigned int pos( world.pucks[id]->cell_pos );
+  const unsigned int last( pucks.back() );
+  pucks[pos] = last;
+  world.pucks[last]->cell_pos = pos;
+  pucks.pop_back();
+}
+
+void Robot::PoseChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  const unsigned int partitions( Pool::threads );
+
+  for( unsigned int i(first); i<last; i++ )
+    {
+      if( ! Tiles::Simulates( i ) )
+	continue;
+
+      UpdatePose( i );
+      
+      const unsigned int from( world.cell[i] );
+      const unsigned int to( Cell( world.x[i], world.y[i] ) );
+
+#if METRICS
+      if( to != from )
+	Metrics::workers[worker].migrations++;
+#endif
+
+      // a CSR matrix is rebuilt from scratch, so just note the new cell
+      if( matrix_type == MATRIX_CSR )
+	world.cell[i] = to;
+      // otherwise, if we changed cell, queue the move for the owners
+      // of the old and new cells to apply later
+      else if( to != from )
+	{
+	  const migration_t m = { i, world.id[i], world.held_puck[i], from, to };
+	  leaving[ worker * partitions + Partition(from) ].push_back( m );
+	  entering[ worker * partitions + Partition(to) ].push_back( m );
+	}
+    }
+}
+
+// collect the moves queued for a partition by every worker. Sorting
+// by robot id makes the resulting cell contents independent of how
+// the pose phase was split between threads, and of which slots the
+// robots are in.
+static std::vector<migration_t>& GatherMoves( std::vector<std::vector<migration_t> >& queues, 
+					      unsigned int partition )
+{
+  const unsigned int partitions( Pool::threads );
+  std::vector<migration_t>& moves( partition_moves[partition] );
+  moves.clear();
+
+  for( unsigned int w(0); w<Pool::threads; w++ )
+    {
+      std::vector<migration_t>& q( queues[ w * partitions + partition ] );
+      moves.insert( moves.end(), q.begin(), q.end() );
+      q.clear();
+    }
+  
+  std::sort( moves.begin(), moves.end(), MoveOrder );
+  return moves;
+}
+
+void Robot::LeaveCellsChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  for( unsigned int p(first); p<last; p++ )
     {
-      puck_held->x = pose.x;
-      puck_held->y = pose.y;
+      std::vector<migration_t>& moves( GatherMoves( leaving, p ) );
+      FOR_EACH( m, moves )
+	{
+	  if( m->slot != NO_SLOT )
+	    CellAt( m->from ).RemoveRobot( m->slot );
+	  if( m->puck >= 0 )
+	    CellAt( m->from ).RemovePuck( m->puck );
+	  ReleaseCell( m->from );
+	}
     }
-	
-  if( newindex != index )
+}
+
+void Robot::EnterCellsChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  for( unsigned int p(first); p<last; p++ )
     {
-      EraseAll( this, matrix[index].robots );
-      matrix[newindex].robots.push_back( this );		
-            
-      if( puck_held )
+      std::vector<migration_t>& moves( GatherMoves( entering, p ) );
+      FOR_EACH( m, moves )
 	{
-	  EraseAll( puck_held, matrix[index].pucks );
-	  matrix[newindex].pucks.push_back( puck_held );		
+	  if( m->slot != NO_SLOT )
+	    {
+	      CellAt( m->to ).AddRobot( m->slot );
+	      world.cell[m->slot] = m->to;
+	    }
+
+	  if( m->puck >= 0 )
+	    {
+	      CellAt( m->to ).AddPuck( m->puck );
+	      world.pucks[m->puck]->index = m->to;
+	    }
 	}
-			
-      index = newindex;
     }
+}
 
-  // compute the new bounding box of the fov
-  FovBBox( sensor_bbox );
+#if METRICS
+// note the sizes of the sensor vectors filled for a robot
+static inline void CountSensed( Metrics::worker_t& m, unsigned int robots, unsigned int pucks )
+{
+  m.sensed++;
+  m.see_robots += robots;
+  m.see_pucks += pucks;
+  m.see_robots_max = std::max( m.see_robots_max, robots );
+  m.see_pucks_max = std::max( m.see_pucks_max, pucks );
+}
+#endif
+
+void Robot::SenseChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  for( unsigned int i(first); i<last; i++ )
+    {
+      if( ! Tiles::Simulates( i ) )
+	continue;
+
+      UpdateSensors( i, worker );
+#if METRICS
+      const Robot* r( world.handle[i] );
+      CountSensed( Metrics::workers[worker], r->see_robots.size(), r->see_pucks.size() );
+#endif
+    }
+}
+
+void Robot::ControlChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  for( unsigned int i(first); i<last; i++ )
+    {
+      // teams control their robots in TeamChunk()
+      if( homes[ world.home_id[i] ]->team || ! Tiles::Simulates( i ) )
+	continue;
+      
+      Robot* r( world.handle[i] );
+      
+      // controllers see a snapshot of their pose and write a new
+      // speed, which is copied back into the world
+      r->pose = Pose( world.x[i], world.y[i], world.a[i] );
+      r->Controller();
+      world.v[i] = r->speed.v;
+      world.w[i] = r->speed.w;
+      
+      if( world.claim[i] >= 0 || world.dropping[i] )
+	actors[worker].push_back( i );
+    }
+}
+
+void Robot::TeamChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  for( unsigned int h(first); h<last; h++ )
+    {
+      Team* team( homes[h]->team );
+      if( team == NULL )
+	continue;
+      
+      team->Update();
+      FOR_EACH( s, team->slots )
+	if( world.claim[*s] >= 0 || world.dropping[*s] )
+	  actors[worker].push_back( *s );
+    }
+}
+
+void Robot::ResolveActions()
+{
+  // gather everyone who acted, in id order, so the result does not
+  // depend on how the work was split between threads or on the
+  // robots' slots
+  static std::vector<unsigned int> acted;
+  acted.clear();
+  FOR_EACH( a, actors )
+    {
+      acted.insert( acted.end(), a->begin(), a->end() );
+      a->clear();
+    }
+  std::sort( acted.begin(), acted.end(), IdOrder );
+  
+  // drops first, since they can't conflict
+  FOR_EACH( s, acted )
+    if( world.dropping[*s] )
+      {
+	world.handle[*s]->Drop();
+	world.dropping[*s] = false;
+      }
+  
+  // then each puck goes to its strongest claim
+  FOR_EACH( s, acted )
+    {
+      const int id( world.claim[*s] );
+      if( id >= 0 && world.pucks[id]->claim == ClaimPriority( world.id[*s] ) )
+	world.handle[*s]->PickupPuck( world.pucks[id] );
+    }
+  
+  FOR_EACH( s, acted )
+    {
+      const int id( world.claim[*s] );
+      if( id >= 0 )
+	{
+	  world.pucks[id]->claim = 0;
+	  world.claim[*s] = -1;
+	}
+    }
+}
+
+void Robot::RobotSenseChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  for( unsigned int i(first); i<last; i++ )
+    if( Tiles::Simulates( i ) )
+      UpdateRobotSensor( i, worker );
+}
+
+// the puck pass runs second, so counts both sensors when it is done
+void Robot::PuckSenseChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  for( unsigned int i(first); i<last; i++ )
+    {
+      if( ! Tiles::Simulates( i ) )
+	continue;
+
+      UpdatePuckSensor( i, worker );
+#if METRICS
+      const Robot* r( world.handle[i] );
+      CountSensed( Metrics::workers[worker], r->see_robots.size(), r->see_pucks.size() );
+#endif
+    }
 }
 
 static inline void grow_bounds( bounds_t& b, double val )
@@ -468,108 +1421,367 @@ static inline void grow_bounds( bounds_t& b, double val )
 }
 
 // find the axis-aligned bounding box of our field of view
-void Robot::FovBBox( bbox_t& box )
+void Robot::FovBBox( double x, double y, double a, bbox_t& box )
 {
-  box.x.min = pose.x;
-  box.x.max = pose.x;
-  box.y.min = pose.y;
-  box.y.max = pose.y;
+  box.x.min = x;
+  box.x.max = x;
+  box.y.min = y;
+  box.y.max = y;
   
   const double halffov = fov/2.0;
-  const double lefta( pose.a + halffov );
-  const double righta( pose.a - halffov );
+  const double lefta( a + halffov );
+  const double righta( a - halffov );
 
   // extreme left of FOV
-  grow_bounds( box.x, pose.x + range * fast_cos( lefta ) );
-  grow_bounds( box.y, pose.y + range * fast_sin( lefta ) );
+  grow_bounds( box.x, x + range * fast_cos( lefta ) );
+  grow_bounds( box.y, y + range * fast_sin( lefta ) );
   
   // extreme right of FOV
-  grow_bounds( box.x, pose.x + range * fast_cos( righta ) );
-  grow_bounds( box.y, pose.y + range * fast_sin( righta ) );
+  grow_bounds( box.x, x + range * fast_cos( righta ) );
+  grow_bounds( box.y, y + range * fast_sin( righta ) );
   
   // points where the fov crosses an axis
   if( lefta > 0 && righta < 0 )
-    grow_bounds( box.x, pose.x + range );
+    grow_bounds( box.x, x + range );
   
   if( lefta > M_PI/2.0 && righta < M_PI/2.0 )
-    grow_bounds( box.y, pose.y + range );
+    grow_bounds( box.y, y + range );
   
   if( lefta > M_PI && righta < M_PI )
-    grow_bounds( box.x, pose.x - range );
+    grow_bounds( box.x, x - range );
   
   if( lefta > -M_PI && righta < -M_PI )
-    grow_bounds( box.x, pose.x - range );
+    grow_bounds( box.x, x - range );
   
   if( lefta > -M_PI/2.0 && righta < -M_PI/2.0 )
-    grow_bounds( box.y, pose.y - range );
+    grow_bounds( box.y, y - range );
+
+  // The corners above use fast_cos() and fast_sin(), which are out by
+  // up to about 1e-3, and the sensors test bearings with fast_atan2(),
+  // out by up to about 5e-3 radians, so the box could fall just inside
+  // what the sensors can see. Matrix cells narrower than the range,
+  // such as subcells, would then miss things near the edge of view.
+  const double slack( range * 1e-2 + 4.0 * std::numeric_limits<real_t>::epsilon() * worldsize );
+  box.x.min -= slack;
+  box.x.max += slack;
+  box.y.min -= slack;
+  box.y.max += slack;
 }
 
-void Home::UpdatePucks()
+void Home::ScorePucks()
 {
-  // we score 1 point for each puck that timed out here
-  while( pucks.size() && (Robot::updates - (*pucks.begin())->delivery_time > score_time) )
+  // take the pucks due now off the wheel
+  static std::vector<Puck*> due;
+  due.clear();
+  
+  const unsigned int s( WheelSlot( Robot::updates ) );
+  for( Puck* p(wheel_head[s]); p; p = p->wheel_next )
     {
-      (*pucks.begin())->Replace();
-      score++;
-      
-      // printf( "%llu home: %d score: %d\n", Robot::updates, id, score );
+      assert( DueTime( p ) == Robot::updates );
+      due.push_back( p );
+    }
+  wheel_head[s] = wheel_tail[s] = NULL;
+  
+  // we score 1 point for each puck that timed out at a home
+  FOR_EACH( it, due )
+    {
+      Puck* p( *it );
+      p->wheel_prev = p->wheel_next = NULL;
+      p->home->score++;
+      p->home->pucks--;
+      p->home = NULL;
+      p->Replace();
+    }
+}
+
+Team::Team( Home* home )
+  : home(home)
+{
+  home->team = this;
+
+  const World& world( Robot::world );
+  for( unsigned int s(0); s<world.RobotCount(); s++ )
+    if( world.home_id[s] == home->id )
+      {
+	slots.push_back( s );
+	robots.push_back( world.handle[s] );
+      }
+
+  const unsigned int n( slots.size() );
+  x.resize( n );
+  y.resize( n );
+  a.resize( n );
+  holding.resize( n );
+  v.resize( n );
+  w.resize( n );
+  action.resize( n );
+}
+
+void Team::Gather()
+{
+  const World& world( Robot::world );
+  for( unsigned int i(0); i<slots.size(); i++ )
+    {
+      const unsigned int s( slots[i] );
+      x[i] = world.x[s];
+      y[i] = world.y[s];
+      a[i] = world.a[s];
+      holding[i] = world.held_puck[s] >= 0;
+    }
+}
+
+void Team::Apply( unsigned int i )
+{
+  // the robots' handles are only touched to act on pucks
+  Robot::world.v[slots[i]] = v[i];
+  Robot::world.w[slots[i]] = w[i];
+
+  if( action[i] == ACTION_DROP )
+    robots[i]->Drop();
+  else if( action[i] == ACTION_PICKUP )
+    robots[i]->Pickup();
+}
+
+void Team::Update()
+{
+  Gather();
+  Control();
+  for( unsigned int i(0); i<slots.size(); i++ )
+    Apply( i );
+}
+
+// add the time since t to a phase, and time the next from now
+static void EndPhase( phase_t phase, double& t )
+{
+  const double now( Seconds() );
+  phase_seconds[phase] += now - t;
+#if METRICS
+  Metrics::Phase( phase, now - t );
+#endif
+  t = now;
+}
+
+static void PrintPhaseTimes( const char* label, const double* seconds, uint64_t count )
+{
+  printf( "[Antix] %s", label );
+  for( int p(0); p<PHASE_COUNT; p++ )
+    printf( " %s %.3f", phase_names[p], 1e3 * seconds[p] / count );
+  puts( " (msec per update)" );
+}
+
+// record the phase times for the current thread count and move on to
+// the next, printing the speedup of each phase relative to one thread
+// when the sweep is done
+static void SweepStep()
+{
+  sweep_seconds.push_back( std::vector<double>( phase_seconds, phase_seconds + PHASE_COUNT ) );
+  
+  char label[32];
+  snprintf( label, 32, "%u threads:", Pool::active );
+  PrintPhaseTimes( label, phase_seconds, Robot::sweep_updates );
+  
+  for( int p(0); p<PHASE_COUNT; p++ )
+    phase_seconds[p] = 0.0;
+  
+  if( Pool::active < Pool::threads )
+    {
+      ++Pool::active;
+      return;
     }
+  
+  printf( "[Antix] speedup threads" );
+  for( int p(0); p<PHASE_COUNT; p++ )
+    printf( " %8s", phase_names[p] );
+  printf( " %8s\n", "total" );
+  
+  const std::vector<double>& base( sweep_seconds[0] );
+  double base_total(0);
+  for( int p(0); p<PHASE_COUNT; p++ )
+    base_total += base[p];
+  
+  for( unsigned int t(0); t<sweep_seconds.size(); t++ )
+    {
+      const std::vector<double>& row( sweep_seconds[t] );
+      double total(0);
+      printf( "[Antix] speedup %7u", t+1 );
+      for( int p(0); p<PHASE_COUNT; p++ )
+	{
+	  printf( " %8.2f", base[p] / row[p] );
+	  total += row[p];
+	}
+      printf( " %8.2f\n", base_total / total );
+    }
+  
+  exit(0);
+}
+
+// print the results of the run as key=value pairs on one line, for
+// scripts such as antix-bench to read. The updates and seconds are
+// those of this run, so a run restored from a checkpoint doesn't
+// count the updates made before it.
+static void PrintSummary()
+{
+  const double seconds( started ? Seconds() - first_update_seconds : 0 );
+  printf( "[Antix] summary updates=%llu seconds=%.6f startup=%.6f rss_kb=%ld robots=%u pucks=%u homes=%u threads=%u",
+	  (long long unsigned)(Robot::updates - first_update),
+	  seconds,
+	  (started ? first_update_seconds : Seconds()) - init_seconds,
+	  PeakRSS(),
+	  Robot::world.RobotCount(),
+	  (unsigned int)Robot::world.pucks.size(),
+	  (unsigned int)Robot::homes.size(),
+	  Pool::threads );
+  
+  unsigned int score(0);
+  FOR_EACH( h, Robot::homes )
+    score += (*h)->score;
+  printf( " score=%u seen_robots=%llu seen_pucks=%llu precision=%u",
+	  score, (long long unsigned)seen_robots, (long long unsigned)seen_pucks,
+	  (unsigned int)(8 * sizeof(real_t)) );
+
+  for( int p(0); p<PHASE_COUNT; p++ )
+    printf( " %s_s=%.6f", phase_names[p], phase_seconds[p] );
+  puts( "" );
 }
 
 void Robot::UpdateAll()
 {
   // if we've done enough updates, exit the program
   if( updates_max > 0 && updates > updates_max )
-    exit(1);
+    {
+      if( Tiles::count )
+	Tiles::Finish( seen_robots, seen_pucks );
+      PrintPhaseTimes( "phase times:", phase_seconds, updates - first_update );
+      PrintSummary();
+      if( Checkpoint::filename )
+	Checkpoint::Write( true );
+      exit(0);
+    }
   
   if( ! Robot::paused )
     {
-      // not safe to do in parallel
-      FOR_EACH( r, homes )
-       	(*r)->UpdatePucks();
+      double t( Seconds() );
+
+      if( ! started )
+	{
+	  started = true;
+	  first_update = updates;
+	  first_update_seconds = t;
+	  printf( "[Antix] startup took %.3f sec, peak RSS %ld KB\n", t - init_seconds, PeakRSS() );
+	}
+
+      // resize the matrix to suit how crowded it has become, before
+      // any moves between cells are queued
+      if( grid_type != GRID_FIXED && updates % grid_interval == 0 )
+	TuneGrid();
+
+      // keep robots that are near each other in the world near each
+      // other in memory, as they scatter
+      if( reorder_interval && updates % reorder_interval == 0 && world.committed == world.RobotCount() )
+	Reorder();
 
-      // not safe to do in parallel
-      FOR_EACH( r, population )
-	(*r)->UpdatePose();
+      EndPhase( PHASE_LAYOUT, t );
+
+      // not safe to do in parallel, but costs nothing while no pucks are due
+      Home::ScorePucks();
+
+      EndPhase( PHASE_PUCKS, t );
+
+      // place any newly created robots in the world
+      if( world.committed < world.RobotCount() )
+	CommitHandles();
+
+      const unsigned int count( world.RobotCount() );
+
+      // move every robot in parallel, queueing changes of matrix cell
+      Pool::ParallelFor( count, PoseChunk );
+
+      if( matrix_type == MATRIX_CSR )
+	csr.Rebuild();
+      else
+	{
+	  // apply the queued changes, one thread per matrix
+	  // partition. All removals must finish before any insertions,
+	  // since both update a migrating robot's position in its cell.
+	  Pool::ParallelFor( Pool::threads, LeaveCellsChunk, 1 );
+	  Pool::ParallelFor( Pool::threads, EnterCellsChunk, 1 );
+	}
+
+      EndPhase( PHASE_POSE, t );
+
+      if( Tiles::count )
+	Tiles::Exchange();
+
+      EndPhase( PHASE_EXCHANGE, t );
+
+      if( grid_type == GRID_HIERARCHICAL )
+	RebuildSubgrids();
+
+      EndPhase( PHASE_SUBGRID, t );
 		  
-      // unblock the workers - they are waiting on this condition var
-      pthread_mutex_lock( &sync_mutex );
-      worker_count = 2;
-      //puts( "main thread signalling workers" );
-      pthread_cond_broadcast( &cond_start );
-      pthread_mutex_unlock( &sync_mutex );
-      
-      // wait for all the last update job to complete - it will
-      // signal the worker_threads_done condition var
-      pthread_mutex_lock( &sync_mutex );
-      while( worker_count  )
+      // sensing only reads shared data, so split it across all threads
+      FOR_EACH( it, sensed )
 	{
-	  //puts( "main thread waiting for workers to finish" );
-	  pthread_cond_wait( &cond_done, &sync_mutex );
+	  it->robots.clear();
+	  it->pucks.clear();
 	}
-      pthread_mutex_unlock( &sync_mutex );		 
-      //puts( "main thread awakes" );
 
-      // wait for worker threads to complete
+      if( split_sensing )
+	{
+	  Pool::ParallelFor( count, RobotSenseChunk );
+	  Pool::ParallelFor( count, PuckSenseChunk );
+	}
+      else
+	Pool::ParallelFor( count, SenseChunk );
+
+      EndPhase( PHASE_SENSE, t );
+
+      FOR_EACH( it, sensed )
+	{
+	  seen_robots += it->robots.size();
+	  seen_pucks += it->pucks.size();
+	}
+	  
+      if( Remote::processes )
+	Remote::Exchange();
+      else
+	{
+	  // controllers run in parallel, recording the pucks they want
+	  // to pick up or drop, which are dealt with afterwards
+	  deferring = true;
+	  Pool::ParallelFor( homes.size(), TeamChunk, 1 );
+	  Pool::ParallelFor( count, ControlChunk );
+	  deferring = false;
 	  
-      // not necessarily safe to do in parallel
-      FOR_EACH( r, population )
-	(*r)->Controller();
+	  ResolveActions();
+	}
+
+      EndPhase( PHASE_CONTROL, t );
 
       ++updates;
       
+      if( Checkpoint::filename && Checkpoint::interval && updates % Checkpoint::interval == 0 )
+	Checkpoint::Write( false );
+
+      Recorder::Capture();
+
+      if( sweep_updates && updates % sweep_updates == 0 )
+	SweepStep();
+
+#if METRICS
+      if( Metrics::interval && updates % Metrics::interval == 0 )
+	Metrics::Report();
+#else
       static double lastseconds=0;
       
       if( updates % 10 == 0 ) // every hundred updates
 	{
-	  static struct timeval tv;
-	  gettimeofday( &tv, NULL );
-	  
-	  double seconds = tv.tv_sec + tv.tv_usec/1e6;
+	  double seconds = Seconds();
 	  double interval = seconds - lastseconds;
-	  printf( "[%llu] %.2f (%.2f)\n", updates, 10.0/interval, updates/(seconds-start_seconds) );      
+	  printf( "[%llu] %.2f (%.2f)\n", (long long unsigned)updates, 10.0/interval, updates/(seconds-start_seconds) );      
 	  lastseconds = seconds;
 	}
+#endif
     }
   
   // possibly snooze to save CPU and slow things down 
@@ -579,70 +1791,99 @@ void Robot::UpdateAll()
 
 void Robot::Run()
 {
+  if( Replay::filename )
+    {
 #if GRAPHICS
-  UpdateGui();
-#else
-  while( 1 )
-    UpdateAll();
+      if( ! headless )
+	{
+	  UpdateGui(); // GLUT calls Replay::Update() when idle
+	  return;
+	}
 #endif
-}
+      while( 1 )
+	Replay::Update();
+    }
 
-// wrap around torus
-double Robot::WrapDistance( double d )
-{
-  const double halfworld( worldsize * 0.5 );
-  
-  if( d > halfworld )
-    d -= worldsize;
-  else if( d < -halfworld )
-    d += worldsize;
+  // place the robots now, so a restore or a recording starts from them
+  CommitHandles();
 
-  return d;
-}
+  if( Checkpoint::restore_filename )
+    Checkpoint::Restore();
 
-/** Normalize a length to within 0 to worldsize. */
-double Robot::DistanceNormalize( double d )
-{
-  while( d < 0 ) d += worldsize;
-  while( d > worldsize ) d -= worldsize;
-  return d; 
-} 
+  if( Tiles::count )
+    Tiles::Start();
 
-/** Normalize an angle to within +/_ M_PI. */
-double Robot::AngleNormalize( double a )
-{
-  while( a < -M_PI ) a += 2.0*M_PI;
-  while( a >  M_PI ) a -= 2.0*M_PI;	 
-  return a;
-}	 
+  if( Remote::processes )
+    Remote::Start();
 
+  // after the controller processes are forked, so they don't inherit
+  // the recording
+  if( Recorder::filename )
+    Recorder::Start();
 
+#if GRAPHICS
+  if( ! headless )
+    {
+      UpdateGui(); // GLUT calls UpdateAll() when idle
+      return;
+    }
+#endif
+  
+  while( 1 )
+    UpdateAll();
+}
+
+// wrap around torus
 Puck::Puck( double x, double y ) 
-  : held(true), home(NULL), index(0), delivery_time(0), x(x), y(y) 
+  : id( Robot::world.AddPuck(this) ), held(true), home(NULL), index(Robot::Cell(x,y)), cell_pos(0), delivery_time(0), x(x), y(y),
+    wheel_prev(NULL), wheel_next(NULL), claim(0)
 {
-  Robot::matrix[Robot::Cell(x,y)].pucks.push_back(this);  
+  if( Robot::matrix_type != Robot::MATRIX_CSR )
+    Robot::CellAt( index ).AddPuck( id );
   Drop();
 }
 
 Puck::~Puck()
 {
-  EraseAll( this, Robot::matrix[Robot::Cell(x,y)].pucks );
+  if( Robot::matrix_type != Robot::MATRIX_CSR )
+    {
+      Robot::CellAt( index ).RemovePuck( id );
+      Robot::ReleaseCell( index );
+    }
+  if( home )
+    WheelRemove( this );
 }
 
 void Puck::Replace()
 {
-  EraseAll( this, Robot::matrix[Robot::Cell(x,y)].pucks );
-  
-  x = drand48() * Robot::worldsize;
-  y = drand48() * Robot::worldsize;
+  // drawn from this puck's own stream, so pucks can be replaced in
+  // any order
+  const uint64_t key( Rng::Key( Rng::STREAM_PUCK, id ) );
+  x = Rng::Uniform( key, Robot::updates, 0 ) * Robot::worldsize;
+  y = Rng::Uniform( key, Robot::updates, 1 ) * Robot::worldsize;
   
-  Robot::matrix[Robot::Cell(x,y)].pucks.push_back(this);  
+  // the move to a new cell is made along with the robots' moves in
+  // the pose phase, in parallel
+  const unsigned int to( Robot::Cell(x,y) );
+  if( Robot::matrix_type == Robot::MATRIX_CSR )
+    index = to;
+  else if( to != index )
+    {
+      const migration_t m = { NO_SLOT, NO_SLOT, (int)id, index, to };
+      leaving[ Partition(index) ].push_back( m );
+      entering[ Partition(to) ].push_back( m );
+    }
   
   if( home )
     {
-      EraseAll( this, home->pucks );
+      WheelRemove( this );
+      home->pucks--;
       home = NULL;
     }
+
+  // a puck landing in another tile is dropped there
+  if( Tiles::count && Tiles::Replaced( this ) )
+    return;
   
   Drop();  
 }
@@ -656,7 +1897,8 @@ void Puck::Pickup()
   
   if( home )
     {
-      EraseAll( this, home->pucks );
+      WheelRemove( this );
+      home->pucks--;
       home = NULL;
     }
 }
@@ -667,22 +1909,14 @@ void Puck::Drop()
   
   held = false;	     
   
-  double closest_range( 1e12 ); // huge
-  FOR_EACH( h, Robot::homes )
-    {
-      double range = hypot( (*h)->x-x, (*h)->y-y );
-      if( range < closest_range && range < (*h)->r )
-	{
-	  home = *h;
-	  closest_range = range;
-	}
-    }
+  home = Home::Containing( x, y );
   
   if( home )
     {
       // record the time of delivery
       delivery_time = Robot::updates;
-      home->pucks.push_back( this );	     
+      home->pucks++;
+      WheelInsert( this );
     }
 
   //printf( "puck %p dropped at home %p\n", this, home );
@@ -8,14 +8,35 @@
 #include <vector>
 #include <set>
 #include <list>
+#include <unordered_map>
+#include <algorithm>
 #include <math.h> 
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 
+// build with -DGRAPHICS=0 to leave out the GLUT window entirely
+#ifndef GRAPHICS
 #define GRAPHICS 1
+#endif
 #define DEBUGVIS 0
 
+// build with -DMETRICS=0 to leave out the instrumentation in metrics.cc
+#ifndef METRICS
+#define METRICS 1
+#endif
+
+// build with -DSINGLE=1 to hold the world's positions, headings and
+// speeds in single precision. Each pass over the world then touches
+// half the bytes, and the sensor kernels test twice as many
+// candidates per vector.
+#ifndef SINGLE
+#define SINGLE 0
+#endif
+
 // handy STL iterator macro pair. Use FOR_EACH(I,C){ } to get an iterator I to
 // each item in a collection C.
 #define VAR(V,init) __typeof(init) V=(init)
@@ -23,6 +44,12 @@
 
 namespace Antix
 {
+#if SINGLE
+  typedef float real_t;
+#else
+  typedef double real_t;
+#endif
+
   /** Convert radians to degrees. */
   inline double rtod( double r ){ return( r * 180.0 / M_PI ); }
   /** Convert degrees to radians */
@@ -31,7 +58,7 @@ namespace Antix
   // bounds type - specifies a range of values
   typedef struct
   {
-    double min, max;
+    real_t min, max;
   } bounds_t;
 
   // bounding box type - specifies a 2d range of values
@@ -39,22 +66,417 @@ namespace Antix
   {
     bounds_t x, y;
   } bbox_t;
-  
+
+  /** Counter-based random numbers. A draw is a hash of the seed, a
+      stream, a key such as a robot's or a puck's id, the update and
+      a count of draws made by that key in that update. No state is
+      shared, so any thread can draw without locking, and a run comes
+      out the same whatever the number of threads. */
+  class Rng
+  {
+  public:
+    typedef enum { STREAM_HOME=1, STREAM_ROBOT, STREAM_PUCK } stream_t;
+
+    static const uint64_t SETUP = ~0ULL; // the update used for draws made while building the world
+
+    static int64_t seed;
+
+    /** Scramble the bits of a number, as in SplitMix64. */
+    static inline uint64_t Mix( uint64_t z )
+    {
+      z += 0x9e3779b97f4a7c15ULL;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      return( z ^ (z >> 31) );
+    }
+
+    /** The part of a draw that depends only on the stream and the
+	key, which a frequent caller can keep. */
+    static inline uint64_t Key( stream_t stream, uint64_t key )
+    {
+      return( Mix( Mix( (uint64_t)seed + stream ) ^ key ) );
+    }
+
+    static inline uint64_t Bits( uint64_t key, uint64_t update, uint64_t count )
+    {
+      return( Mix( Mix( key ^ update ) + count ) );
+    }
+
+    /** A number in [0,1) for the count'th draw by key in this update. */
+    static inline double Uniform( uint64_t key, uint64_t update, uint64_t count )
+    {
+      return( (Bits( key, update, count ) >> 11) * (1.0 / 9007199254740992.0) );
+    }
+
+    static inline double Uniform( stream_t stream, uint64_t key, uint64_t update, uint64_t count )
+    {
+      return( Uniform( Key( stream, key ), update, count ) );
+    }
+  };
+
   class Home;
+  class Puck;
+  class Robot;
+  class Team;
+
+  // the phases of an update, timed separately. Layout is resizing the
+  // matrix and reordering the robots, which only happen now and then;
+  // exchange is passing robots between tiles and subgrid is rebuilding
+  // the coarse grid, which only some runs do at all.
+  typedef enum { PHASE_PUCKS=0, PHASE_POSE, PHASE_SENSE, PHASE_CONTROL,
+		 PHASE_LAYOUT, PHASE_EXCHANGE, PHASE_SUBGRID, PHASE_COUNT } phase_t;
+  extern const char* phase_names[PHASE_COUNT];
+
+  /** Structure-of-arrays store holding the simulation state of every
+      robot. The core update loops in antix.cc run directly over these
+      arrays, so each pass streams through contiguous memory instead
+      of chasing Robot pointers around the heap. Robot objects are
+      thin handles that refer to their slot in here. Robots may be
+      moved to other slots by Robot::Reorder(), but keep their id. */
+  class World
+  {
+  public:
+    std::vector<real_t> x, y, a; // 2d position and orientation
+    std::vector<real_t> v, w; // forward and turn speed
+    std::vector<unsigned int> home_id; // index into Robot::homes
+    std::vector<int> held_puck; // index into pucks, or -1 if not holding
+    std::vector<int> claim; // puck each robot asked to pick up this update, or -1
+    std::vector<char> dropping; // true iff the robot asked to drop its puck this update
+    std::vector<unsigned int> cell; // the matrix cell that currently holds each robot
+    std::vector<unsigned int> cell_pos; // position of each robot in its cell's list
+    std::vector<bbox_t> sensor_bbox; // bounding box of each robot's field of view
+    std::vector<Robot*> handle; // the Robot object that owns each slot
+    std::vector<unsigned int> id; // the robot in each slot, numbered in order of creation
+    
+    std::vector<Puck*> pucks; // every puck, indexed by Puck::id
+    
+    unsigned int committed; // slots below this have been placed in the matrix
+
+    World() : committed(0) {}
+    
+    /** Reserve space for the expected number of robots and pucks. */
+    void Reserve( unsigned int robots, unsigned int puck_count );
+
+    /** Size the robots' arrays, to be filled in place. */
+    void Resize( unsigned int robots );
+
+    /** Append a robot to the store and return its slot. */
+    unsigned int AddRobot( Robot* r, unsigned int home_id, double x, double y, double a );
+
+    /** Append a puck to the store and return its index. */
+    unsigned int AddPuck( Puck* p );
+
+    unsigned int RobotCount() const { return x.size(); }
+  };
+
+  /** Hands out memory for objects that live until the program
+      ends, one after another in large blocks, so objects created
+      together lie together in memory. Nothing is freed. Not
+      thread-safe: create robots, pucks and homes from one thread. */
+  class Arena
+  {
+  public:
+    Arena( size_t block_size = 1 << 20 );
+
+    void* Allocate( size_t size );
+
+  private:
+    size_t block_size;
+    char* next; // free space in the current block
+    size_t left; // bytes free after next
+  };
+
+  /** A persistent pool of worker threads that runs loops split into
+      chunks. The thread calling ParallelFor() takes part as worker
+      0, so a pool of one thread runs everything inline. */
+  class Pool
+  {
+  public:
+    /** Processes items [first,last) of a loop on behalf of worker,
+	which is less than Pool::threads. */
+    typedef void (*func_t)( unsigned int first, unsigned int last, unsigned int worker );
+
+    /** Start the worker threads. Call once before ParallelFor(). */
+    static void Init( unsigned int threads );
+
+    /** Call func on chunks of [0,count) using the active workers,
+	returning when all are done. A chunk size of 0 picks one
+	that gives each worker several chunks. */
+    static void ParallelFor( unsigned int count, func_t func, unsigned int chunk=0 );
+
+    static unsigned int threads; // number of threads in the pool, including the caller
+    static unsigned int active; // number of threads taking part in loops, up to threads
+  };
+
+#if METRICS
+  /** Counters showing where the time in each update goes, reported
+      every few updates in place of the frame rate. Each worker
+      thread writes only its own counters, so recording costs a few
+      additions. */
+  class Metrics
+  {
+  public:
+    // phase times are binned by powers of two microseconds
+    static const unsigned int BUCKETS = 24;
+
+    typedef struct
+    {
+      uint64_t migrations; // robots that changed matrix cell
+      uint64_t sensed; // robots whose sensors were updated
+      uint64_t see_robots, see_pucks; // total detections
+      unsigned int see_robots_max, see_pucks_max; // most detections by one robot
+      double busy_seconds; // time spent running chunks of parallel loops
+      char pad[64]; // keeps each worker's counters on its own cache lines
+    } worker_t;
+
+    static std::vector<worker_t> workers; // indexed by pool worker
+    static uint64_t histogram[PHASE_COUNT][BUCKETS];
+    static double phase_max[PHASE_COUNT]; // longest time spent in each phase
+    static double phase_total[PHASE_COUNT];
+    static double pool_seconds; // time spent in parallel loops, times the workers taking part
+    static unsigned int interval; // updates between reports, or 0 for none
+    static FILE* out; // where reports are written
+
+    /** Size the counters for the pool and open the output file, if
+	one is given. */
+    static void Init( unsigned int threads, const char* filename );
+
+    /** A monotonic clock in seconds, for timing short intervals. */
+    static double Now();
+
+    /** Record the time taken by one phase of an update. */
+    static void Phase( phase_t phase, double seconds );
+
+    /** Print everything recorded since the last report, then start
+	again. */
+    static void Report();
+  };
+#endif
+
+  /** Runs the robot controllers in separate processes, each serving
+      a share of the homes. Every update the simulator copies each
+      home's sensor results into a shared-memory region, and the
+      process serving that home writes back a speed and any pickup or
+      drop for each robot. Both sides hand over a region by bumping a
+      counter, so an update costs a copy per robot and a few
+      syscalls per process at most. */
+  class Remote
+  {
+  public:
+    static unsigned int processes; // number of controller processes, or 0 to run controllers in the simulator
+    static bool child; // true in a controller process
+
+    /** Fork the controller processes. Call once every robot exists. */
+    static void Start();
+
+    /** Send every robot's sensor results to its controller process,
+	wait for their commands and apply them in slot order. */
+    static void Exchange();
+
+    /** In a controller process, record what the robot whose
+	controller is running wants done with pucks. */
+    static void IntendPickup( unsigned int puck );
+    static void IntendDrop();
+  };
+
+  /** Splits the world between processes, each simulating a tile: a
+      strip of the matrix's columns, with its robots and pucks. Each
+      process holds every robot and puck, but updates only those in
+      its own tile. It sees one column either side of its tile as
+      ghosts, copies of its neighbours' edge columns. Every update,
+      after the robots move, each tile writes to its shared-memory
+      region the robots and pucks that have left it, with their
+      state, and its edge columns. Then it reads what the others
+      wrote for it. Robots only pick up pucks in their own tile. */
+  class Tiles
+  {
+  public:
+    static unsigned int count; // number of tiles, or 0 to simulate the whole world in one process
+    static unsigned int index; // the tile simulated by this process
+    static unsigned int first_column, last_column; // this tile's matrix columns, [first,last)
+    static std::vector<char> own_robot, own_puck; // indexed by slot and puck id: true iff in this tile
+
+    /** Fork a process for each tile but the first, which this
+	process keeps. Call once every robot is in the matrix. */
+    static void Start();
+
+    /** Hand robots and pucks that have left this tile to their new
+	tiles, swap edge columns with the neighbouring tiles and take
+	in what they sent. Call after the robots move, before they
+	sense. */
+    static void Exchange();
+
+    /** Note that a puck has been replaced. Returns true iff it
+	landed in another tile, which drops it there. */
+    static bool Replaced( const Puck* puck );
+
+    /** At the end of the run, add the other tiles' scores and
+	detections to this one's. Only the first tile's process
+	returns. */
+    static void Finish( uint64_t& seen_robots, uint64_t& seen_pucks );
+
+    /** true iff this process updates the robot in slot */
+    static inline bool Simulates( unsigned int slot )
+    {
+      return( count == 0 || own_robot[slot] );
+    }
+
+    /** true iff this process may pick up the puck */
+    static inline bool SimulatesPuck( unsigned int id )
+    {
+      return( count == 0 || own_puck[id] );
+    }
+  };
+
+  /** Binary snapshots of the whole simulation, from which a run can
+      be resumed. A checkpoint is written by a forked child process
+      from its copy-on-write image of the simulator, so the simulation
+      stops only for the fork. Restoring maps the file and copies the
+      world's arrays out of it in bulk. The world must first be
+      created with the same options as the run that wrote it, and a
+      restored run then proceeds exactly as the original did. */
+  class Checkpoint
+  {
+  public:
+    static const uint32_t VERSION = 6; // bump when the layout changes
+
+    static const char* filename; // where checkpoints are written, or NULL for none
+    static unsigned int interval; // updates between checkpoints, or 0 for only at the end of the run
+    static const char* restore_filename; // checkpoint to resume from, or NULL
+
+    /** Start writing a checkpoint of the world as it stands. If the
+	last one is still being written this one is skipped, unless
+	wait is true, when it waits for both to finish. */
+    static void Write( bool wait );
+
+    /** Replace the state of the world made at startup with that in
+	restore_filename. Call once every robot exists and is in the
+	matrix. Exits if the checkpoint does not fit the world. */
+    static void Restore();
+
+    /** Append a value's bytes to a controller's saved state, and
+	read them back, in the same order. */
+    template <class T>
+    static void Put( std::vector<char>& out, const T& value )
+    {
+      const char* p( (const char*)&value );
+      out.insert( out.end(), p, p + sizeof(T) );
+    }
+
+    template <class T>
+    static void Get( const char*& in, T& value )
+    {
+      memcpy( &value, in, sizeof(T) );
+      in += sizeof(T);
+    }
+
+    template <class T>
+    static void Put( std::vector<char>& out, const std::vector<T>& values )
+    {
+      Put( out, (uint64_t)values.size() );
+      const char* p( (const char*)values.data() );
+      out.insert( out.end(), p, p + values.size() * sizeof(T) );
+    }
+
+    template <class T>
+    static void Get( const char*& in, std::vector<T>& values )
+    {
+      uint64_t size;
+      Get( in, size );
+      values.resize( size );
+      memcpy( values.data(), in, size * sizeof(T) );
+      in += size * sizeof(T);
+    }
+  };
+
+  /** Streams the state of the world to a file every few updates,
+      for analysis offline. Each frame holds every robot's pose
+      quantized to 16 bits, who is carrying a puck, the pucks'
+      positions and the home scores, encoded as differences from the
+      frame before. Every so often a keyframe is encoded from scratch,
+      and an index of keyframes at the end of the file lets a reader
+      start at any update. The simulator only copies the quantized
+      state into one of two buffers; a background thread encodes and
+      writes the other. */
+  class Recorder
+  {
+  public:
+    static const uint32_t VERSION = 1; // bump when the format changes
+
+    static const char* filename; // where frames are written, or NULL for none
+    static unsigned int interval; // updates between frames
+    static unsigned int keyframe_interval; // frames between keyframes
+
+    /** Open the file, write the header and the current state as the
+	first frame, and start the writing thread. Call once every
+	robot exists. */
+    static void Start();
+
+    /** Record a frame if one is due this update. */
+    static void Capture();
+
+    /** Write the last frames and the index, and close the file. Runs
+	at exit. */
+    static void Stop();
+  };
+
+  /** Plays back a recording made by Recorder instead of
+      simulating. The world is made from the recording, and each frame
+      is decoded straight into the world's arrays, so the viewer draws
+      it as it would a live run, at whatever speed it can draw. Run
+      headless, it decodes every frame as fast as it can, printing a
+      checksum of what it saw for regression checks and optionally
+      writing each frame as an image. */
+  class Replay
+  {
+  public:
+    static const char* filename; // recording to play, or NULL to simulate
+    static const char* dump_prefix; // if set, frames are written to <prefix><update>.ppm
+    static unsigned int dump_size; // width and height of those images in pixels
+    static double rate; // frames played per second in the viewer
+
+    /** Map the recording and set the world's size and counts from
+	it. Called by Robot::Init(). */
+    static void Open();
+
+    /** Create the homes, robots and pucks of the recording, and show
+	its first frame. Call instead of creating them. */
+    static void Start();
+
+    /** Show the frame due now, or the next one when headless. Called
+	in place of Robot::UpdateAll(). */
+    static void Update();
+
+    /** Jump to the first frame at or after this update. */
+    static void Seek( uint64_t update );
+
+    /** Move by a fraction of the recording, back if negative. */
+    static void Skip( double fraction );
+  };
 
   class Puck
   {
   public:
+    unsigned int id; // index into World::pucks
     bool held; // true iff carried by a robot 
     Home* home;
     unsigned int index; // the matrix cell that currently contains this puck
+    unsigned int cell_pos; // position of this puck in its cell's list
     uint64_t delivery_time;
-    double x,y; // location
+    real_t x,y; // location
+    Puck *wheel_prev, *wheel_next; // neighbours while waiting to score at a home
+    uint64_t claim; // priority of the strongest claim on this puck this update, or 0
     
     /** constructor places a puck at specified pose */
     Puck( double x, double y ); 
     ~Puck();
+
+    // pucks are allocated in order from an arena
+    static void* operator new( size_t size );
+    static void operator delete( void* ptr ) {}
     
+    /** Move to a random place. Changes of matrix cell are queued and
+	applied in the next pose phase, so call this only before it. */
     void Replace();
 
     //Puck() 
@@ -77,26 +499,83 @@ namespace Antix
       
     Color( double r, double g, double b ) :	r(r), g(g), b(b) {}
       
-      // get a random color
-      static Color Random()
+      // get a random color for home id
+      static Color Random( unsigned int id )
       {
-	return Color( drand48(), drand48(), drand48() );
+	const uint64_t key( Rng::Key( Rng::STREAM_HOME, id ) );
+	return Color( Rng::Uniform( key, Rng::SETUP, 0 ),
+		      Rng::Uniform( key, Rng::SETUP, 1 ),
+		      Rng::Uniform( key, Rng::SETUP, 2 ) );
       }
       
     } color; 
 
     
-    std::list<Puck*> pucks;
+    unsigned int pucks; // delivered here and waiting to score
 
     unsigned int score;
 
     double x, y, r;
 
+    Team* team; // controls all the home's robots at once, or NULL to control each one separately
+
     Home( unsigned int id, const Color& color, double x, double y, double r );
 
-    void UpdatePucks();
+    // homes are allocated in order from an arena
+    static void* operator new( size_t size );
+    static void operator delete( void* ptr ) {}
+
+    /** Score every puck whose time at its home has run out, and put
+	it back in the world. */
+    static void ScorePucks();
+
+    /** The pucks waiting to score at every home, in the order they
+	will be scored, and a way to replace them all, as when
+	restoring a checkpoint. */
+    static void WaitingPucks( std::vector<Puck*>& pucks );
+    static void SetWaitingPucks( const std::vector<Puck*>& pucks );
+
+    /** Build the grid of homes that Containing() and Nearest() use.
+	Call once every home exists and before either is used. The
+	grid is only read after that, so controllers running in
+	parallel can call them. */
+    static void Index();
+
+    /** The home whose area contains the point, the closest if
+	several do, or NULL if none does. Distances wrap around the
+	torus. Takes constant time on average, using the grid of
+	homes. */
+    static Home* Containing( double x, double y );
+
+    /** The home whose centre is closest to the point, across the
+	wrap, or NULL if there are no homes. */
+    static Home* Nearest( double x, double y );
   };
 	
+  /** A robot's sensor records: a range of one of the per-worker
+      vectors they were written to. Cheap to copy, and valid until the
+      sensors are next updated. */
+  template <class T>
+  class SenseView
+  {
+  public:
+    typedef const T* const_iterator;
+
+    SenseView() : records(NULL), first(0), last(0) {}
+    SenseView( const std::vector<T>& records, unsigned int first, unsigned int last )
+      : records(&records), first(first), last(last) {}
+
+    const T* begin() const { return( first == last ? NULL : &(*records)[first] ); }
+    const T* end() const { return( first == last ? NULL : &(*records)[0] + last ); }
+    size_t size() const { return( last - first ); }
+    bool empty() const { return( first == last ); }
+    const T& operator[]( size_t i ) const { return (*records)[first + i]; }
+
+  private:
+    const std::vector<T>* records;
+    unsigned int first, last;
+  };
+
   class Robot
   {
   public:
@@ -109,18 +588,45 @@ namespace Antix
 	 /** update all robots */
 	 static void UpdateAll();
 
-	 /** Normalize a length to within 0 to worldsize. */
-	 static double DistanceNormalize( double d );
+	 // These work in the precision of their argument, so the sensors
+	 // get the same answers from the scalar code as from the vector
+	 // kernels in either precision.
+
+	 /** Normalize a length to within 0 and below worldsize. */
+	 template<class T> static T DistanceNormalize( T d )
+	 {
+		const T world( worldsize );
+		while( d < 0 ) d += world;
+		while( d >= world ) d -= world;
+		return d; 
+	 }
 
 	 /** Normalize an angle to within +/_ M_PI. */
-	 static double AngleNormalize( double a );
+	 template<class T> static T AngleNormalize( T a )
+	 {
+		while( a < T(-M_PI) ) a += T(2.0*M_PI);
+		while( a >  T(M_PI) ) a -= T(2.0*M_PI);	 
+		return a;
+	 }
 	 
 	 /** Wrap distances around the torus */
-	 static double WrapDistance( double d );
+	 template<class T> static T WrapDistance( T d )
+	 {
+		const T world( worldsize );
+		const T halfworld( worldsize * 0.5 );
+  
+		if( d > halfworld )
+		  d -= world;
+		else if( d < -halfworld )
+		  d += world;
+
+		return d;
+	 }
 
 	 /** Start running the simulation. Does not return. */
 	 static void Run();
 
+	 static bool headless; // if true, run without a window as fast as possible
 	 static bool paused; // runs only when this is false
 	 static bool show_data; // controls visualization of pixel data
 	 static double fov;      // sensor detects objects within this angular field-of-view about the current heading
@@ -132,6 +638,7 @@ namespace Antix
 
 	 static std::vector<Home*> homes;
 	 static std::vector<Robot*> population;
+	 static World world; // the state of every robot, indexed by slot
 	 
 	 static uint64_t updates; // number of simulation steps so far	 
 	 static uint64_t updates_max; // number of simulation steps to run before quitting (0 means infinity)
@@ -139,6 +646,10 @@ namespace Antix
 	 static unsigned int home_population; // number of robots
 	 static unsigned int puck_count; // number of pucks that exist in the world
 	 static unsigned int sleep_msec; // number of milliseconds to sleep at each update
+	 static unsigned int threads; // number of threads used to update the world
+	 static unsigned int sweep_updates; // if non-zero, measure speedup at 1..threads, this many updates each
+	 static bool split_sensing; // if true, sense robots and pucks in separate passes
+	 static bool teams; // if true, control the robots of each home as a team
 
 	 static unsigned int gui_interval; // number of milliseconds between window redraws
 	 static Robot* first;
@@ -147,17 +658,246 @@ namespace Antix
 	 class MatrixCell
 	 {
 	 public:
-	   std::vector<Robot*> robots;
-	   std::vector<Puck*> pucks;
+	   std::vector<unsigned int> robots; // world slots
+	   std::vector<unsigned int> pucks; // puck ids
+
+	   /** Add and remove entries in constant time. Robots and pucks
+		   record their position in the list, so removal moves the
+		   last entry into the gap instead of searching. */
+	   void AddRobot( unsigned int slot );
+	   void RemoveRobot( unsigned int slot );
+	   void AddPuck( unsigned int id );
+	   void RemovePuck( unsigned int id );
 	 };
 
-	 static std::vector<Robot::MatrixCell> matrix;
+	 /** The matrix stored as compressed sparse rows, rebuilt from
+		 scratch every update by a parallel counting sort. The robots
+		 in cell c are robots[robot_start[c]] up to but not including
+		 robots[robot_start[c+1]], in slot order, and likewise for
+		 pucks. */
+	 class MatrixCSR
+	 {
+	 public:
+	   std::vector<unsigned int> robot_start, robots;
+	   std::vector<unsigned int> puck_start, pucks;
+
+	   // per-thread cell counts, [thread * cells + cell]
+	   std::vector<unsigned int> robot_count, puck_count;
+	   
+	   /** Sort all robots and pucks into cells using their current
+		   positions. */
+	   void Rebuild();
+	 };
+
+	 /** The matrix stored sparsely, as a hash table of the occupied
+		 cells in each partition of the matrix, so memory grows with
+		 the number of occupied cells rather than with the world's
+		 area. A cell is added when something enters it and removed
+		 when it empties. Only the thread that owns a partition
+		 changes its table, so moves between cells need no locks. */
+	 class MatrixSparse
+	 {
+	 public:
+	   // one table per partition, as in antix.cc's Partition()
+	   std::vector<std::unordered_map<unsigned int,MatrixCell> > partitions;
+
+	   inline std::unordered_map<unsigned int,MatrixCell>& Table( unsigned int c )
+	   {
+		 return partitions[ (uint64_t)c * partitions.size() / (matrixwidth * matrixwidth) ];
+	   }
+
+	   /** The cell, which is added if it is empty. */
+	   inline MatrixCell& Get( unsigned int c )
+	   {
+		 return Table( c )[c];
+	   }
+
+	   /** The cell, or NULL if it is empty. */
+	   inline const MatrixCell* Find( unsigned int c )
+	   {
+		 std::unordered_map<unsigned int,MatrixCell>& table( Table( c ) );
+		 std::unordered_map<unsigned int,MatrixCell>::const_iterator it( table.find( c ) );
+		 return( it == table.end() ? NULL : &it->second );
+	   }
+
+	   /** A cell that is known to be occupied. Safe to call from
+		   several threads at once, as it never adds a cell. */
+	   inline MatrixCell& At( unsigned int c )
+	   {
+		 return Table( c ).find( c )->second;
+	   }
+
+	   /** Remove the cell if it has emptied. */
+	   inline void Release( unsigned int c )
+	   {
+		 std::unordered_map<unsigned int,MatrixCell>& table( Table( c ) );
+		 std::unordered_map<unsigned int,MatrixCell>::iterator it( table.find( c ) );
+		 if( it != table.end() && it->second.robots.empty() && it->second.pucks.empty() )
+		   table.erase( it );
+	   }
+
+	   /** the number of occupied cells */
+	   unsigned int Occupied() const;
+	 };
+
+	 /** the available ways of storing the matrix */
+	 typedef enum { MATRIX_CELLS=0, MATRIX_CSR, MATRIX_SPARSE } matrix_type_t;
+	 static matrix_type_t matrix_type; // chosen at startup
+
+	 static std::vector<Robot::MatrixCell> matrix; // used if matrix_type is MATRIX_CELLS
+	 static MatrixCSR csr; // used if matrix_type is MATRIX_CSR
+	 static MatrixSparse sparse; // used if matrix_type is MATRIX_SPARSE
 	 static unsigned int matrixwidth;
+	 static double matrix_budget; // most bytes a dense matrix may take before a sparse one is used instead
+
+	 /** The bytes a dense matrix of this width would take, stored as
+		 chosen, or 0 if it is stored sparsely. */
+	 static double DenseMatrixBytes( unsigned int width );
+
+	 /** A cell of a matrix stored as MATRIX_CELLS or MATRIX_SPARSE, for
+		 adding and removing robots and pucks. */
+	 static inline MatrixCell& CellAt( unsigned int c )
+	 {
+	   return( matrix_type == MATRIX_SPARSE ? sparse.Get( c ) : matrix[c] );
+	 }
+
+	 /** Call after removing something from a cell, in case it has emptied. */
+	 static inline void ReleaseCell( unsigned int c )
+	 {
+	   if( matrix_type == MATRIX_SPARSE )
+		 sparse.Release( c );
+	 }
+
+	 /** Empty every cell of a matrix stored as MATRIX_CELLS or
+		 MATRIX_SPARSE. */
+	 static void ClearMatrix();
+
+	 /** the available ways of sizing the matrix: cells as wide as
+		 the sensor range, cells sized to suit how crowded the world
+		 is, or those with the crowded cells near homes split again */
+	 typedef enum { GRID_FIXED=0, GRID_AUTO, GRID_HIERARCHICAL } grid_type_t;
+	 static grid_type_t grid_type; // chosen at startup
+	 static unsigned int grid_interval; // updates between resizing the matrix, if not GRID_FIXED
+
+	 /** A crowded matrix cell near a home, split into side x side
+		 subcells, which are rebuilt every update from the cell's
+		 contents in the same way as MatrixCSR. Subcell (i,j) is
+		 entry i + j*side. */
+	 class Subgrid
+	 {
+	 public:
+	   unsigned int cell;
+	   unsigned int side;
+	   std::vector<unsigned int> robot_start, robots;
+	   std::vector<unsigned int> puck_start, pucks;
+	   std::vector<unsigned int> subcell; // of each of the cell's robots or pucks, while rebuilding
+
+	   /** Sort the cell's robots and pucks into subcells. */
+	   void Rebuild();
+	 };
+
+	 static std::vector<Subgrid> subgrids; // the first hot_cells are in use
+	 static unsigned int hot_cells;
+	 static std::vector<int> cell_subgrid; // index into subgrids for each cell, or -1, unless the matrix is sparse
+
+	 /** A run of robots and pucks that a sensor may detect: all of
+		 a cell, or one subcell of a hot cell */
+	 class Span
+	 {
+	 public:
+	   unsigned int cell;
+	   const unsigned int *robots_begin, *robots_end;
+	   const unsigned int *pucks_begin, *pucks_end;
+	 };
+
+	 /** Find the spans that hold everything inside a sensor's
+		 bounding box, however the matrix is stored and sized. */
+	 static void QuerySpans( const bbox_t& box, std::vector<Span>& out );
+
+	 /** Choose the matrix width that makes sensing cheapest for the
+		 density the robots and pucks are at now, and move them into
+		 the resized matrix if it changes. */
+	 static void TuneGrid();
+
+	 /** Move everything into a matrix of this width. */
+	 static void Regrid( unsigned int width );
+
+	 /** Find the hot cells and rebuild their subgrids. Call once the
+		 matrix is up to date, before sensing. */
+	 static void RebuildSubgrids();
+
+	 static unsigned int reorder_interval; // updates between reordering the robots, or 0 for never
+
+	 /** Move the robots to new slots in Z-order of their matrix
+		 cells, so robots near each other in the world are near each
+		 other in memory. Their handles, the matrix and the teams
+		 follow them. Call between updates, once every robot has
+		 been committed. */
+	 static void Reorder();
+
+	 /** Give each slot the handle and home of the robot whose id it
+		 holds, after restoring reordered robots. */
+	 static void AssignHandles();
+
+	 /** Get the range of robot slots in a cell, however the matrix is stored. */
+	 static inline void CellRobots( unsigned int c, const unsigned int*& begin, const unsigned int*& end )
+	 {
+	   if( matrix_type == MATRIX_CSR )
+		 {
+		   begin = csr.robots.data() + csr.robot_start[c];
+		   end = csr.robots.data() + csr.robot_start[c+1];
+		 }
+	   else if( matrix_type == MATRIX_SPARSE )
+		 {
+		   const MatrixCell* cell( sparse.Find( c ) );
+		   begin = cell ? cell->robots.data() : NULL;
+		   end = cell ? begin + cell->robots.size() : NULL;
+		 }
+	   else
+		 {
+		   begin = matrix[c].robots.data();
+		   end = begin + matrix[c].robots.size();
+		 }
+	 }
+
+	 /** Get the range of puck ids in a cell, however the matrix is stored. */
+	 static inline void CellPucks( unsigned int c, const unsigned int*& begin, const unsigned int*& end )
+	 {
+	   if( matrix_type == MATRIX_CSR )
+		 {
+		   begin = csr.pucks.data() + csr.puck_start[c];
+		   end = csr.pucks.data() + csr.puck_start[c+1];
+		 }
+	   else if( matrix_type == MATRIX_SPARSE )
+		 {
+		   const MatrixCell* cell( sparse.Find( c ) );
+		   begin = cell ? cell->pucks.data() : NULL;
+		   end = cell ? begin + cell->pucks.size() : NULL;
+		 }
+	   else
+		 {
+		   begin = matrix[c].pucks.data();
+		   end = begin + matrix[c].pucks.size();
+		 }
+	 }
+
+	 /** the available implementations of the sensor tests */
+	 typedef enum { KERNEL_SCALAR=0, KERNEL_SSE2, KERNEL_AVX2 } kernel_type_t;
+	 static kernel_type_t kernel_type; // the fastest available unless chosen at startup
+
+	 class SeeRobot;
+	 class SeePuck;
+	 static void TestPucksInSpan( unsigned int slot, const Span& span, std::vector<SeePuck>& out );
+	 static void TestRobotsInSpan( unsigned int slot, const Span& span, std::vector<SeeRobot>& out );
 
-	 void TestPucksInCell( const MatrixCell& cell );
-	 void TestRobotsInCell( const MatrixCell& cell );
+	 /** Copy the pose of robots created since the last update from
+			 their handles into the world, and place them in the
+			 matrix. Constructors of subclasses may set the pose after
+			 Robot's constructor has run, so this is deferred until the
+			 simulation starts. */
+	 static void CommitHandles();
 
-	 unsigned int index; // the matrix cell that currently holds this robot
+	 unsigned int slot; // this robot's index in the world store
 
 #if GRAPHICS
 	 static int winsize; // initial size of the window in pixels
@@ -172,8 +912,9 @@ namespace Antix
 	 void Draw();	 
 #endif
 	
-	 bbox_t sensor_bbox; 
-	 void FovBBox( bbox_t& box );
+	 /** find the axis-aligned bounding box of the field of view of a
+			 robot at this pose */
+	 static void FovBBox( double x, double y, double a, bbox_t& box );
 
 	 // deliver pucks to this location
 	 Home* home;
@@ -188,14 +929,17 @@ namespace Antix
 
 			//Pose( const Pose &p ) : x(p.x), y(p.y), a(p.a) {}	
 			
-			// get a random pose 
-			static Pose Random()
+			// get a random starting pose for the robot in slot
+			static Pose Random( unsigned int slot )
 			{
-			  return Pose( drand48() * Robot::worldsize, 
-								drand48() * Robot::worldsize, 
-								Robot::AngleNormalize( drand48() * (M_PI*2.0)));
+			  const uint64_t key( Rng::Key( Rng::STREAM_ROBOT, slot ) );
+			  return Pose( Rng::Uniform( key, Rng::SETUP, 0 ) * Robot::worldsize, 
+								Rng::Uniform( key, Rng::SETUP, 1 ) * Robot::worldsize, 
+								Robot::AngleNormalize( Rng::Uniform( key, Rng::SETUP, 2 ) * (M_PI*2.0)));
 			}
-		} pose; // instance: robot is located at this pose
+		} pose; // instance: robot is located at this pose. The world
+				  // holds the authoritative copy; this is refreshed
+				  // before each call to Controller().
 		
 		class Speed
 		{		
@@ -205,39 +949,50 @@ namespace Antix
 	  	
 			// constructor sets speeds to zero
 		Speed() : v(0.0), w(0.0) {}		
-		} speed; // instance: robot is moving this fast
+		Speed( double v, double w ) : v(v), w(w) {}
+		} speed; // instance: robot is moving this fast. Copied into
+				  // the world after each call to Controller().
 		
+	 // flags of sensor records
+	 static const unsigned int SEE_HASPUCK = 1; // the robot seen is carrying a puck
+	 static const unsigned int SEE_HELD = 1; // the puck seen is being carried
+
+		/** A robot detected by the sensor. The record holds only the
+				other robot's slot and where it is from here; the rest of
+				its state is looked up in the world. */
 		class SeeRobot
 		{
 		public:
-		  const Home* home;
-		  Pose pose;
-		  Speed speed;
+		  unsigned int slot; // the other robot's world slot
+		  unsigned int flags; // SEE_HASPUCK
 		  double range;
 		  double bearing;
-		  bool haspuck;
 			
-		SeeRobot( const Home* home, const Pose& p, const Speed& s, const double range, const double bearing, const bool haspuck )
-		  : home(home), pose(p), speed(s), range(range), bearing(bearing), haspuck(haspuck)
+		SeeRobot( unsigned int slot, const double range, const double bearing, const bool haspuck )
+		  : slot(slot), flags(haspuck ? SEE_HASPUCK : 0), range(range), bearing(bearing)
 			{ /* empty */}
+
+		  Home* GetHome() const { return homes[world.home_id[slot]]; }
+		  Pose GetPose() const { return Pose( world.x[slot], world.y[slot], world.a[slot] ); }
+		  bool HasPuck() const { return flags & SEE_HASPUCK; }
 	 };
 
-	 
-	 /** A sense vector containing information about all the robots
-			 detected in my field of view */
-	 std::vector<SeeRobot> see_robots;
+	 /** The robots detected in my field of view this update. A view
+			 into the sensor records of the thread that sensed them. */
+	 SenseView<SeeRobot> see_robots;
 	 
 	 static inline unsigned int Cell( double x )
 	 {
 		const double d = Robot::worldsize / (double)Robot::matrixwidth;
 		
-		while( x > worldsize ) // wraparound
+		while( x >= worldsize ) // wraparound
 		  x -= worldsize;
 		
 		while( x < 0 ) // wraparound
 		  x += worldsize;
 		
-		 return floor( x / d );
+		// x just below worldsize can still round up to the last cell plus one
+		return std::min( (unsigned int)floor( x / d ), matrixwidth - 1 );
 	 }
 	 
 	 static inline int CellNoWrap( double x )
@@ -262,24 +1017,40 @@ namespace Antix
 		return (Cell(x) + (Cell(y) * Robot::matrixwidth) );		 
 	 }
 	 	 	 
-	 static std::vector<Puck> pucks;
-
+	 /** A puck detected by the sensor, by its id, and whether it was
+			 held when it was seen. */
 	 class SeePuck
 	 {
 	 public:
-		 Puck* puck;
-		 bool held;
-		 double bearing;		 
+		 unsigned int id; // the puck's index in the world
+		 unsigned int flags; // SEE_HELD
 		 double range;
+		 double bearing;		 
 		 
-	 SeePuck( Puck* puck,  const double range, const double bearing, const bool held )
-		: puck(puck), held(held), bearing(bearing), range(range) 
+	 SeePuck( unsigned int id,  const double range, const double bearing, const bool held )
+		: id(id), flags(held ? SEE_HELD : 0), range(range), bearing(bearing) 
 		 { /* empty */}
+
+		 Puck* GetPuck() const { return world.pucks[id]; }
+		 bool Held() const { return flags & SEE_HELD; }
 	 };
 	 
-	 /** A sense vector containing information about all the pucks
-			 detected in my field of view */
-	 std::vector<SeePuck> see_pucks;	 	 
+	 /** The pucks detected in my field of view this update */
+	 SenseView<SeePuck> see_pucks;
+
+	 /** The sensor records written by one worker thread in an update.
+			 They are cleared, not freed, at the start of each update, so
+			 once they have grown sensing allocates nothing. */
+	 class Sensed
+	 {
+	 public:
+		 std::vector<SeeRobot> robots;
+		 std::vector<SeePuck> pucks;
+		 std::vector<Span> spans; // to search for the robot being sensed
+		 char pad[64]; // keeps each worker's vectors on their own cache lines
+	 };
+
+	 static std::vector<Sensed> sensed; // indexed by pool worker	 	 
 #if DEBUGVIS
 	 std::vector<Robot*> neighbors;
 	 std::vector<Puck*> neighbor_pucks;
@@ -291,82 +1062,220 @@ namespace Antix
 	 
 	 // destructor
 	 virtual ~Robot() {}
+
+	 // robots, including subclasses, are allocated in order from an
+	 // arena, so walking the world's handles walks memory in order
+	 static void* operator new( size_t size );
+	 static void operator delete( void* ptr ) {}
 	 
 	 /** Attempt to pick up a puck. Returns true if one was picked up,
-			 else false. */
+			 else false. While controllers run in parallel this only
+			 stakes a claim, which loses to any stronger claim on the
+			 same puck, so the robot may not be holding next update. */
 	 bool Pickup(); 
+
+	 /** Pick up this puck, if we hold nothing and no one else holds
+			 it. Returns true if it was picked up. */
+	 bool PickupPuck( Puck* puck );
 	 
 	 /** Attempt to drop a puck. Returns true if one was dropped, else
 			 false. */
 	 bool Drop();
+
+	 /** Record a controller process's request to drop the puck we
+			 hold and to pick up this one, if not NULL, for
+			 ResolveActions() to carry out with everyone else's. Call
+			 from one thread only. */
+	 void Request( bool drop, Puck* puck );
+
+	 /** Carry out the pickups and drops recorded this update, in id
+			 order, drops first. Each puck goes to the strongest claim
+			 on it. */
+	 static void ResolveActions();
 	 
 	 /** Returns true if we are currently holding a puck. */
 	 bool Holding() const;
 	  
-	 /** pure virtual - subclasses must implement this method  */
+	 /** pure virtual - subclasses must implement this method. It
+			 runs in parallel with other robots' controllers, so should
+			 use Random() rather than drand48(). */
 	 virtual void Controller() = 0;
 
+	 /** A random number in [0,1) from this robot's own stream, keyed
+			 by its slot and the update, which is safe to call from
+			 parallel controllers and does not depend on the number of
+			 threads. */
+	 double Random()
+	 {
+		if( rng_update != updates )
+		  {
+			 rng_update = updates;
+			 rng_draws = 0;
+		  }
+		return Rng::Uniform( rng_key, updates, rng_draws++ );
+	 }
+
+	 /** Append the state of this robot that the world does not hold
+			 to a checkpoint, including its controller's, and read it
+			 back. */
+	 void Save( std::vector<char>& out ) const;
+	 void Load( const char*& in );
+
+	 /** Subclasses whose controllers keep state between updates
+			 save it here, with Checkpoint::Put(), and read back exactly
+			 what they wrote with Checkpoint::Get(). */
+	 virtual void SaveState( std::vector<char>& out ) const {}
+	 virtual void LoadState( const char*& in ) {}
+
+	 static bool deferring; // true while controllers run in parallel, when pickups and drops are recorded to be carried out afterwards
+
 	private:
-	 Puck* puck_held;
-	 
-	 // move the robot
-	 void UpdatePose();
+	 uint64_t rng_key; // Rng::Key() of this robot's stream
+	 uint64_t rng_update; // the update of the last draw
+	 uint64_t rng_draws; // draws made in that update
+
+	 // stake our claim on a puck, which ResolveActions() settles
+	 void ClaimPuck( Puck* puck );
+
+	 // move the robot in this world slot. Touches only this robot and
+	 // its puck, so it is safe to call in parallel.
+	 static void UpdatePose( unsigned int slot );
+
+	 // chunks of the update phases, run by the thread pool
+	 static void PoseChunk( unsigned int first, unsigned int last, unsigned int worker );
+	 static void LeaveCellsChunk( unsigned int first, unsigned int last, unsigned int worker );
+	 static void EnterCellsChunk( unsigned int first, unsigned int last, unsigned int worker );
+	 static void SenseChunk( unsigned int first, unsigned int last, unsigned int worker );
 	 
-	 // update
-	 //void UpdateSensors();
+	 static void RobotSenseChunk( unsigned int first, unsigned int last, unsigned int worker );
+	 static void PuckSenseChunk( unsigned int first, unsigned int last, unsigned int worker );
+	 static void ControlChunk( unsigned int first, unsigned int last, unsigned int worker );
+	 static void TeamChunk( unsigned int first, unsigned int last, unsigned int worker );
+
   public:
-	 void UpdateRobotSensor();
-	 void UpdatePuckSensor();
+	 // update both sensors in one pass over the cells in view,
+	 // writing the records into this worker's buffers
+	 static void UpdateSensors( unsigned int slot, unsigned int worker );
+
+	 // update one sensor at a time
+	 static void UpdateRobotSensor( unsigned int slot, unsigned int worker );
+	 static void UpdatePuckSensor( unsigned int slot, unsigned int worker );
   };	
 
+  /** A controller for all the robots of a home at once, called once
+      per update instead of calling Robot::Controller() for each
+      robot. The team's state is gathered into arrays, one entry per
+      robot in slot order, so a subclass can work on them in simple
+      loops the compiler can vectorize. Create a team after its
+      robots. */
+  class Team
+  {
+  public:
+    typedef enum { ACTION_NONE=0, ACTION_PICKUP, ACTION_DROP } action_t;
+
+    Home* home;
+    std::vector<unsigned int> slots; // world slots of the team's robots
+    std::vector<Robot*> robots; // their handles, for their sensor results
+
+    // read by Control()
+    std::vector<double> x, y, a; // pose
+    std::vector<char> holding; // true iff carrying a puck
+
+    // written by Control()
+    std::vector<double> v, w; // speed
+    std::vector<action_t> action; // what to do with pucks
+
+    Team( Home* home );
+    virtual ~Team() {}
+
+    /** Set the speed and action of every robot. */
+    virtual void Control() = 0;
+
+    /** Save any state Control() keeps between updates in a
+	checkpoint, and read it back, as Robot::SaveState() does. */
+    virtual void SaveState( std::vector<char>& out ) const {}
+    virtual void LoadState( const char*& in ) {}
+
+    /** Gather the team's state, call Control() and apply the results
+	in slot order. */
+    void Update();
+
+    /** Copy the robots' state into the arrays read by Control(). */
+    void Gather();
+
+    /** Give robot i its speed and carry out its action. */
+    void Apply( unsigned int i );
+  };
+
+  /** Vectorized versions of the sensors' range and field of view
+      tests. Test count candidates at (cx[i],cy[i]) against a robot
+      at pose (x,y,a) and write the index, range and bearing of each
+      one seen into found[], ranges[] and bearings[], in order,
+      returning how many were seen. cx and cy must be readable up to
+      the next multiple of KERNEL_PAD entries. The results match the
+      scalar code in TestRobotsInSpan() and TestPucksInSpan() bit for
+      bit. */
+  static const unsigned int KERNEL_PAD( 8 ); // the most lanes of any kernel
+
+  unsigned int SenseKernelSSE2( const real_t* cx, const real_t* cy, unsigned int count,
+				real_t x, real_t y, real_t a,
+				unsigned int* found, real_t* ranges, real_t* bearings );
+  unsigned int SenseKernelAVX2( const real_t* cx, const real_t* cy, unsigned int count,
+				real_t x, real_t y, real_t a,
+				unsigned int* found, real_t* ranges, real_t* bearings );
+  
+  /** true iff this CPU can run the corresponding kernel */
+  bool HaveSSE2();
+  bool HaveAVX2();
+
   // fast approximation to atan2
-  inline double fast_atan2( double y, double x )
+  template<class T> inline T fast_atan2( T y, T x )
   {
-    const double piD2( M_PI/2.0 );
-    double atan;
-    double z = y/x;
+    const T piD2( M_PI/2.0 );
+    T atan;
+    T z = y/x;
     
-    if ( x == 0.0 ){
-      if ( y > 0.0 ) return piD2;
-      if ( y == 0.0 ) return 0.0;
+    if ( x == T(0.0) ){
+      if ( y > T(0.0) ) return piD2;
+      if ( y == T(0.0) ) return 0.0;
       return -piD2;
     }
     
-    if ( fabs( z ) < 1.0 ){
-      atan = z/(1.0 + 0.28*z*z);
-      if ( x < 0.0 ){
-	if ( y < 0.0 ) return atan - M_PI;
-	return atan + M_PI;
+    if ( fabs( z ) < T(1.0) ){
+      atan = z/(T(1.0) + T(0.28)*z*z);
+      if ( x < T(0.0) ){
+	if ( y < T(0.0) ) return atan - T(M_PI);
+	return atan + T(M_PI);
       }
     }
     else{
-      atan = piD2 - z/(z*z + 0.28f);
-      if ( y < 0.0f ) return atan - M_PI;
+      atan = piD2 - z/(z*z + T(0.28f));
+      if ( y < T(0.0f) ) return atan - T(M_PI);
     }
     return atan;
   }
   
-  inline double fast_sin(double x)
+  template<class T> inline T fast_sin( T x )
   {
-    const double B = 4/M_PI;
-    const double C = -4/(M_PI*M_PI);
-    const double P = 0.225;
-    const double y = B * x + C * x * fabs(x);  
+    const T B( 4/M_PI );
+    const T C( -4/(M_PI*M_PI) );
+    const T P( 0.225 );
+    const T y = B * x + C * x * fabs(x);  
     return(  P * (y * fabs(y) - y) + y );   
   }
   
-  inline double fast_cos(double x)
+  template<class T> inline T fast_cos( T x )
   {
-    const double B = 4/M_PI;
-    const double C = -4/(M_PI*M_PI);
-    const double P = 0.225;
+    const T B( 4/M_PI );
+    const T C( -4/(M_PI*M_PI) );
+    const T P( 0.225 );
     
-    x = x + M_PI/2;
-    if(x > M_PI){   // Original x > M_PI/2
-      x -= 2 * M_PI;   // Wrap: cos(x) = cos(x - 2 M_PI)
+    x = x + T(M_PI/2);
+    if(x > T(M_PI)){   // Original x > M_PI/2
+      x -= T(2 * M_PI);   // Wrap: cos(x) = cos(x - 2 M_PI)
     }
     
-    double y = B * x + C * x * fabs(x);  //fast, inprecise
+    T y = B * x + C * x * fabs(x);  //fast, inprecise
     return( P * (y * fabs(y) - y) + y );  
   }
 }; // namespace Antix
@@ -0,0 +1,59 @@
+/****
+     arena.cc
+     version 1
+     Bump allocation of long-lived objects, in order of creation
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <algorithm>
+#include <new>
+#include "antix.h"
+using namespace Antix;
+
+// every allocation keeps this alignment, which suits any type
+static const size_t ALIGN( 16 );
+
+Arena::Arena( size_t block_size )
+  : block_size(block_size), next(NULL), left(0)
+{
+}
+
+void* Arena::Allocate( size_t size )
+{
+  size = (size + ALIGN - 1) & ~(ALIGN - 1);
+
+  // start a new block when this one is full. The rest of the old one
+  // is wasted, which is little as long as objects are small.
+  if( size > left )
+    {
+      const size_t bytes( std::max( size, block_size ) );
+      next = (char*)malloc( bytes );
+      if( next == NULL )
+	throw std::bad_alloc();
+      left = bytes;
+    }
+
+  void* ptr( next );
+  next += size;
+  left -= size;
+  return ptr;
+}
+
+static Arena robot_arena( 16 << 20 );
+static Arena puck_arena( 4 << 20 );
+static Arena home_arena;
+
+void* Robot::operator new( size_t size )
+{
+  return robot_arena.Allocate( size );
+}
+
+void* Puck::operator new( size_t size )
+{
+  return puck_arena.Allocate( size );
+}
+
+void* Home::operator new( size_t size )
+{
+  return home_arena.Allocate( size );
+}
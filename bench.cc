@@ -0,0 +1,389 @@
+/****
+     bench.cc
+     version 1
+     Runs antix-headless through a fixed set of named scenarios and
+     reports the results as CSV or JSON, so runs can be compared.
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+// a world to simulate. Sizes are chosen to keep about 1000 robots
+// per unit area, so density stays similar as the population grows.
+typedef struct
+{
+  const char* name;
+  unsigned int homes;
+  unsigned int home_population;
+  unsigned int pucks;
+  double worldsize;
+  double range;
+  double fov; // degrees
+  unsigned int updates;
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+  // name                 homes  per-home   pucks  size range  fov  updates
+  { "10k-1home",              1,   10000,    1000,  3.2, 0.1,  90, 100 },
+  { "10k-100homes",         100,     100,    1000,  3.2, 0.1,  90, 100 },
+  { "10k-dense",            100,     100,   20000,  3.2, 0.1,  90, 100 },
+  { "100k-100homes",        100,    1000,   10000, 10.0, 0.1,  90,  50 },
+  { "100k-1000homes",      1000,     100,   10000, 10.0, 0.1,  90,  50 },
+  { "100k-sparse",         1000,     100,    1000, 10.0, 0.1,  90,  50 },
+  { "100k-dense",          1000,     100,  200000, 10.0, 0.1,  90,  50 },
+  { "100k-narrow",         1000,     100,   10000, 10.0, 0.05, 30,  50 },
+  { "100k-wide",           1000,     100,   10000, 10.0, 0.2, 180,  50 },
+  { "1M-1000homes",        1000,    1000,  100000, 32.0, 0.1,  90,  20 },
+  { "1M-dense",            1000,    1000, 2000000, 32.0, 0.1,  90,  20 },
+};
+
+static const unsigned int scenario_count( sizeof(scenarios) / sizeof(scenarios[0]) );
+
+// the phases reported by antix, in order, as <phase>_s=<seconds>
+static const char* phases[] = { "pucks", "pose", "sense", "control", "layout", "exchange", "subgrid" };
+static const unsigned int phase_count( sizeof(phases) / sizeof(phases[0]) );
+
+typedef struct
+{
+  const scenario_t* scenario;
+  bool ok;
+  unsigned long long updates;
+  double seconds;
+  double startup_seconds; // creating the world, before the first update
+  unsigned int robots, threads, score;
+  unsigned long long seen_robots, seen_pucks; // detections over the run
+  unsigned int precision; // bits in the simulator's reals
+  long peak_rss_kb;
+  double phase_seconds[sizeof(phases) / sizeof(phases[0])];
+} result_t;
+
+const char usage[] = "antix-bench understands these command line arguments:\n"
+  "  -? : Prints this helpful message.\n"
+  "  -b <path> : the simulator to run (default ./antix-headless).\n"
+  "  -c <path> : also runs this reference simulator, e.g. the double precision build, and reports\n"
+  "              how far scores and detections differ from it. With -u 1 this compares the\n"
+  "              sensors alone, before the runs' paths diverge.\n"
+  "  -f <csv|json> : sets the output format (default csv).\n"
+  "  -l : lists the scenarios and quits.\n"
+  "  -o <file> : writes the results to this file instead of stdout.\n"
+  "  -s <text> : runs only scenarios whose name contains this text. May be repeated.\n"
+  "  -u <int> : overrides the number of updates for every scenario.\n"
+  "  -x <args> : passes these extra arguments to the simulator, e.g. \"-t 8 -m csr\".\n"
+  "  --seed <int> : seeds the simulator (default 0).\n";
+
+enum { OPT_SEED = 256 };
+
+static const struct option long_options[] = {
+  { "seed", required_argument, NULL, OPT_SEED },
+  { NULL, 0, NULL, 0 }
+};
+
+// split a string into words on spaces
+static void AppendWords( const char* str, std::vector<std::string>& words )
+{
+  std::string word;
+  for( const char* c(str); ; c++ )
+    {
+      if( *c == ' ' || *c == 0 )
+	{
+	  if( word.size() )
+	    words.push_back( word );
+	  word.clear();
+	  if( *c == 0 )
+	    break;
+	}
+      else
+	word += *c;
+    }
+}
+
+// find "key=" in a summary line and parse the value that follows
+static bool FindValue( const std::string& line, const char* key, double& value )
+{
+  const std::string pattern( std::string(" ") + key + "=" );
+  const size_t pos( line.find( pattern ) );
+  if( pos == std::string::npos )
+    return false;
+
+  value = atof( line.c_str() + pos + pattern.size() );
+  return true;
+}
+
+static result_t Run( const scenario_t& s, const char* binary,
+		     unsigned int updates, long int seed, const char* extra )
+{
+  result_t r;
+  memset( &r, 0, sizeof(r) );
+  r.scenario = &s;
+
+  char buf[64];
+  std::vector<std::string> args;
+  args.push_back( binary );
+  args.push_back( "--headless" );
+  snprintf( buf, sizeof(buf), "%ld", seed );
+  args.push_back( "--seed" ); args.push_back( buf );
+  snprintf( buf, sizeof(buf), "%u", s.homes );
+  args.push_back( "-h" ); args.push_back( buf );
+  snprintf( buf, sizeof(buf), "%u", s.home_population );
+  args.push_back( "-p" ); args.push_back( buf );
+  snprintf( buf, sizeof(buf), "%u", s.pucks );
+  args.push_back( "-a" ); args.push_back( buf );
+  snprintf( buf, sizeof(buf), "%g", s.worldsize );
+  args.push_back( "-s" ); args.push_back( buf );
+  snprintf( buf, sizeof(buf), "%g", s.range );
+  args.push_back( "-r" ); args.push_back( buf );
+  snprintf( buf, sizeof(buf), "%g", s.fov );
+  args.push_back( "-f" ); args.push_back( buf );
+  snprintf( buf, sizeof(buf), "%u", updates ? updates : s.updates );
+  args.push_back( "-u" ); args.push_back( buf );
+  args.push_back( "-z" ); args.push_back( "0" );
+  if( extra )
+    AppendWords( extra, args );
+
+  std::vector<char*> argv;
+  for( unsigned int i(0); i<args.size(); i++ )
+    argv.push_back( (char*)args[i].c_str() );
+  argv.push_back( NULL );
+
+  int fds[2];
+  if( pipe( fds ) != 0 )
+    {
+      perror( "[Bench] pipe" );
+      exit(-1);
+    }
+
+  const pid_t pid( fork() );
+  if( pid == 0 ) // child: run the simulator with its output into the pipe
+    {
+      close( fds[0] );
+      dup2( fds[1], STDOUT_FILENO );
+      close( fds[1] );
+      execv( binary, &argv[0] );
+      perror( "[Bench] exec" );
+      _exit(127);
+    }
+  close( fds[1] );
+
+  // keep the last summary line the simulator prints
+  std::string line, summary;
+  FILE* in( fdopen( fds[0], "r" ) );
+  int c;
+  while( (c = fgetc( in )) != EOF )
+    if( c == '\n' )
+      {
+	if( line.compare( 0, 16, "[Antix] summary " ) == 0 )
+	  summary = line;
+	line.clear();
+      }
+    else
+      line += (char)c;
+  fclose( in );
+
+  int status(0);
+  struct rusage usage;
+  wait4( pid, &status, 0, &usage );
+
+#ifdef __APPLE__
+  r.peak_rss_kb = usage.ru_maxrss / 1024; // bytes on OS X
+#else
+  r.peak_rss_kb = usage.ru_maxrss; // kilobytes on Linux
+#endif
+
+  double value;
+  r.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && summary.size();
+  if( FindValue( summary, "updates", value ) ) r.updates = value;
+  if( FindValue( summary, "seconds", value ) ) r.seconds = value;
+  if( FindValue( summary, "startup", value ) ) r.startup_seconds = value;
+  if( FindValue( summary, "robots", value ) ) r.robots = value;
+  if( FindValue( summary, "threads", value ) ) r.threads = value;
+  if( FindValue( summary, "score", value ) ) r.score = value;
+  if( FindValue( summary, "seen_robots", value ) ) r.seen_robots = value;
+  if( FindValue( summary, "seen_pucks", value ) ) r.seen_pucks = value;
+  if( FindValue( summary, "precision", value ) ) r.precision = value;
+  for( unsigned int p(0); p<phase_count; p++ )
+    if( FindValue( summary, (std::string(phases[p]) + "_s").c_str(), value ) )
+      r.phase_seconds[p] = value;
+
+  if( ! r.ok )
+    fprintf( stderr, "[Bench] scenario %s failed (status %d)\n", s.name, status );
+
+  return r;
+}
+
+static double UpdatesPerSecond( const result_t& r )
+{
+  return r.seconds > 0 ? r.updates / r.seconds : 0;
+}
+
+static double NsPerRobotUpdate( const result_t& r )
+{
+  return r.updates && r.robots ? 1e9 * r.seconds / ((double)r.updates * r.robots) : 0;
+}
+
+// how far a result is from the reference's, relative to the reference
+static double Error( double value, double reference )
+{
+  return reference ? (value - reference) / reference : 0;
+}
+
+static void PrintCSV( FILE* out, const std::vector<result_t>& results, const std::vector<result_t>& references )
+{
+  fprintf( out, "scenario,ok,robots,threads,updates,seconds,startup_seconds,updates_per_sec,ns_per_robot_update,peak_rss_kb,score,seen_robots,seen_pucks,precision" );
+  for( unsigned int p(0); p<phase_count; p++ )
+    fprintf( out, ",%s_ms_per_update", phases[p] );
+  if( references.size() )
+    fprintf( out, ",ref_ok,ref_precision,ref_score,ref_seen_robots,ref_seen_pucks,score_error,seen_robots_error,seen_pucks_error" );
+  fprintf( out, "\n" );
+
+  for( unsigned int i(0); i<results.size(); i++ )
+    {
+      const result_t& r( results[i] );
+      fprintf( out, "%s,%d,%u,%u,%llu,%.6f,%.6f,%.3f,%.3f,%ld,%u,%llu,%llu,%u",
+	       r.scenario->name, r.ok, r.robots, r.threads, r.updates, r.seconds, r.startup_seconds,
+	       UpdatesPerSecond( r ), NsPerRobotUpdate( r ), r.peak_rss_kb, r.score,
+	       r.seen_robots, r.seen_pucks, r.precision );
+      for( unsigned int p(0); p<phase_count; p++ )
+	fprintf( out, ",%.4f", r.updates ? 1e3 * r.phase_seconds[p] / r.updates : 0 );
+      if( references.size() )
+	{
+	  const result_t& ref( references[i] );
+	  fprintf( out, ",%d,%u,%u,%llu,%llu,%.6f,%.6f,%.6f",
+		   ref.ok, ref.precision, ref.score, ref.seen_robots, ref.seen_pucks,
+		   Error( r.score, ref.score ),
+		   Error( r.seen_robots, ref.seen_robots ),
+		   Error( r.seen_pucks, ref.seen_pucks ) );
+	}
+      fprintf( out, "\n" );
+    }
+}
+
+static void PrintJSON( FILE* out, const std::vector<result_t>& results, const std::vector<result_t>& references )
+{
+  fprintf( out, "[\n" );
+  for( unsigned int i(0); i<results.size(); i++ )
+    {
+      const result_t& r( results[i] );
+      const scenario_t& s( *r.scenario );
+      fprintf( out, "  { \"scenario\": \"%s\", \"ok\": %s,\n", s.name, r.ok ? "true" : "false" );
+      fprintf( out, "    \"homes\": %u, \"home_population\": %u, \"pucks\": %u, \"worldsize\": %g, \"range\": %g, \"fov\": %g,\n",
+	       s.homes, s.home_population, s.pucks, s.worldsize, s.range, s.fov );
+      fprintf( out, "    \"robots\": %u, \"threads\": %u, \"updates\": %llu, \"seconds\": %.6f, \"startup_seconds\": %.6f,\n",
+	       r.robots, r.threads, r.updates, r.seconds, r.startup_seconds );
+      fprintf( out, "    \"updates_per_sec\": %.3f, \"ns_per_robot_update\": %.3f, \"peak_rss_kb\": %ld, \"score\": %u,\n",
+	       UpdatesPerSecond( r ), NsPerRobotUpdate( r ), r.peak_rss_kb, r.score );
+      fprintf( out, "    \"seen_robots\": %llu, \"seen_pucks\": %llu, \"precision\": %u,\n",
+	       r.seen_robots, r.seen_pucks, r.precision );
+      if( references.size() )
+	{
+	  const result_t& ref( references[i] );
+	  fprintf( out, "    \"reference\": { \"ok\": %s, \"precision\": %u, \"score\": %u, \"seen_robots\": %llu, \"seen_pucks\": %llu,\n",
+		   ref.ok ? "true" : "false", ref.precision, ref.score, ref.seen_robots, ref.seen_pucks );
+	  fprintf( out, "      \"score_error\": %.6f, \"seen_robots_error\": %.6f, \"seen_pucks_error\": %.6f },\n",
+		   Error( r.score, ref.score ),
+		   Error( r.seen_robots, ref.seen_robots ),
+		   Error( r.seen_pucks, ref.seen_pucks ) );
+	}
+      fprintf( out, "    \"ms_per_update\": {" );
+      for( unsigned int p(0); p<phase_count; p++ )
+	fprintf( out, "%s \"%s\": %.4f", p ? "," : "", phases[p],
+		 r.updates ? 1e3 * r.phase_seconds[p] / r.updates : 0 );
+      fprintf( out, " } }%s\n", i+1 < results.size() ? "," : "" );
+    }
+  fprintf( out, "]\n" );
+}
+
+int main( int argc, char* argv[] )
+{
+  const char* binary( "./antix-headless" );
+  const char* reference( NULL );
+  const char* extra( NULL );
+  const char* outfile( NULL );
+  bool json( false );
+  unsigned int updates(0);
+  long int seed(0);
+  std::vector<std::string> filters;
+
+  int c;
+  while( ( c = getopt_long( argc, argv, "?b:c:f:lo:s:u:x:", long_options, NULL )) != -1 )
+    switch( c )
+      {
+      case 'b': binary = optarg; break;
+      case 'c': reference = optarg; break;
+      case 'f': json = ( strcmp( optarg, "json" ) == 0 ); break;
+      case 'o': outfile = optarg; break;
+      case 's': filters.push_back( optarg ); break;
+      case 'u': updates = atoi( optarg ); break;
+      case 'x': extra = optarg; break;
+      case OPT_SEED: seed = atol( optarg ); break;
+
+      case 'l':
+	for( unsigned int i(0); i<scenario_count; i++ )
+	  {
+	    const scenario_t& s( scenarios[i] );
+	    printf( "%-16s -h %u -p %u -a %u -s %g -r %g -f %g -u %u\n",
+		    s.name, s.homes, s.home_population, s.pucks,
+		    s.worldsize, s.range, s.fov, s.updates );
+	  }
+	exit(0);
+
+      case '?':
+	puts( usage );
+	exit(0); // ok
+
+      default:
+	fprintf( stderr, "[Bench] Option parse error.\n" );
+	puts( usage );
+	exit(-1); // error
+      }
+
+  std::vector<result_t> results, references;
+  for( unsigned int i(0); i<scenario_count; i++ )
+    {
+      const scenario_t& s( scenarios[i] );
+
+      bool wanted( filters.empty() );
+      for( unsigned int f(0); f<filters.size(); f++ )
+	if( strstr( s.name, filters[f].c_str() ) )
+	  wanted = true;
+      if( ! wanted )
+	continue;
+
+      fprintf( stderr, "[Bench] running %s\n", s.name );
+      results.push_back( Run( s, binary, updates, seed, extra ) );
+      if( reference )
+	references.push_back( Run( s, reference, updates, seed, extra ) );
+    }
+
+  FILE* out( outfile ? fopen( outfile, "w" ) : stdout );
+  if( ! out )
+    {
+      perror( "[Bench] output" );
+      exit(-1);
+    }
+
+  if( json )
+    PrintJSON( out, results, references );
+  else
+    PrintCSV( out, results, references );
+
+  if( outfile )
+    fclose( out );
+
+  for( unsigned int i(0); i<results.size(); i++ )
+    if( ! results[i].ok )
+      return 1;
+  for( unsigned int i(0); i<references.size(); i++ )
+    if( ! references[i].ok )
+      return 1;
+  return 0;
+}
@@ -0,0 +1,413 @@
+/****
+     checkpoint.cc
+     version 1
+     Writes the simulation to a binary file and resumes from one
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "antix.h"
+using namespace Antix;
+
+const char* Checkpoint::filename(NULL);
+unsigned int Checkpoint::interval(0);
+const char* Checkpoint::restore_filename(NULL);
+
+// the child process writing the last checkpoint, or 0
+static pid_t writer(0);
+
+// A checkpoint is a header followed by these sections, each padded
+// to a multiple of 8 bytes:
+//   x, y, a, v, w                real_t[robots]
+//   held_puck                    int[robots]
+//   cell, cell_pos, id           unsigned int[robots]
+//   pucks                        puck_record_t[pucks]
+//   homes                        home_record_t[homes]
+//   waiting                      unsigned int[waiting], in scoring order
+//   state                        char[state_bytes]
+// real_t is float or double as built, and the header records its size
+// in real_bytes, so a checkpoint is only restored at the same
+// precision. The state section holds Robot::Save() for each robot in
+// slot order, then Team::SaveState() for each home with a team. Each
+// robot's place in its matrix cell's list is saved, so the cells can be
+// rebuilt in the same order and the sensors see things in the same
+// order as before. The robots' ids put each robot back in the slot it
+// had been moved to, if they have been reordered.
+
+static const char MAGIC[8] = { 'A','n','t','i','x','C','k','p' };
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t header_bytes;
+  uint64_t updates;
+  uint32_t robots, pucks, homes;
+  uint32_t matrixwidth, matrix_type;
+  uint32_t teams;
+  uint32_t waiting; // pucks waiting to score
+  uint32_t real_bytes; // sizeof(real_t) in the build that wrote it
+  uint32_t grid_type, grid_interval;
+  uint32_t reorder_interval;
+  int64_t seed; // of the random number streams
+  double worldsize;
+  uint64_t state_bytes;
+} header_t;
+
+typedef struct
+{
+  double x, y;
+  uint64_t delivery_time;
+  int home; // id of the home it was delivered to, or -1
+  unsigned int index, cell_pos;
+  int held;
+} puck_record_t;
+
+typedef struct
+{
+  unsigned int score;
+  unsigned int pucks;
+} home_record_t;
+
+static inline size_t Padded( size_t bytes )
+{
+  return( (bytes + 7) & ~(size_t)7 );
+}
+
+static bool WriteSection( FILE* f, const void* data, size_t bytes )
+{
+  static const char zeros[8] = { 0 };
+  return( fwrite( data, 1, bytes, f ) == bytes &&
+	  fwrite( zeros, 1, Padded( bytes ) - bytes, f ) == Padded( bytes ) - bytes );
+}
+
+// the next section of a mapped checkpoint
+template <class T>
+static const T* ReadSection( const char*& p, size_t count )
+{
+  const T* section( (const T*)p );
+  p += Padded( count * sizeof(T) );
+  return section;
+}
+
+// write the checkpoint to a temporary file, then move it into place,
+// so a crash never leaves a partial checkpoint under the real name
+static bool WriteFile()
+{
+  const World& world( Robot::world );
+  const unsigned int robots( world.RobotCount() );
+  const unsigned int pucks( world.pucks.size() );
+  const unsigned int homes( Robot::homes.size() );
+
+  std::vector<Puck*> waiting;
+  Home::WaitingPucks( waiting );
+
+  std::vector<char> state;
+  for( unsigned int s(0); s<robots; s++ )
+    world.handle[s]->Save( state );
+  FOR_EACH( h, Robot::homes )
+    if( (*h)->team )
+      (*h)->team->SaveState( state );
+
+  header_t hdr;
+  memset( &hdr, 0, sizeof(hdr) );
+  memcpy( hdr.magic, MAGIC, sizeof(MAGIC) );
+  hdr.version = Checkpoint::VERSION;
+  hdr.header_bytes = sizeof(hdr);
+  hdr.updates = Robot::updates;
+  hdr.robots = robots;
+  hdr.pucks = pucks;
+  hdr.homes = homes;
+  hdr.matrixwidth = Robot::matrixwidth;
+  hdr.matrix_type = Robot::matrix_type;
+  hdr.teams = Robot::teams;
+  hdr.waiting = waiting.size();
+  hdr.worldsize = Robot::worldsize;
+  hdr.state_bytes = state.size();
+
+  hdr.real_bytes = sizeof(real_t);
+  hdr.grid_type = Robot::grid_type;
+  hdr.grid_interval = Robot::grid_interval;
+  hdr.reorder_interval = Robot::reorder_interval;
+  hdr.seed = Rng::seed;
+
+  std::vector<puck_record_t> puck_records( pucks );
+  for( unsigned int i(0); i<pucks; i++ )
+    {
+      const Puck* p( world.pucks[i] );
+      puck_record_t& rec( puck_records[i] );
+      memset( &rec, 0, sizeof(rec) );
+      rec.x = p->x;
+      rec.y = p->y;
+      rec.delivery_time = p->delivery_time;
+      rec.home = p->home ? (int)p->home->id : -1;
+      rec.index = p->index;
+      rec.cell_pos = p->cell_pos;
+      rec.held = p->held;
+    }
+
+  std::vector<home_record_t> home_records( homes );
+  for( unsigned int i(0); i<homes; i++ )
+    {
+      home_records[i].score = Robot::homes[i]->score;
+      home_records[i].pucks = Robot::homes[i]->pucks;
+    }
+
+  std::vector<unsigned int> waiting_ids;
+  FOR_EACH( p, waiting )
+    waiting_ids.push_back( (*p)->id );
+
+  std::string tmp( std::string( Checkpoint::filename ) + ".tmp" );
+  FILE* f( fopen( tmp.c_str(), "wb" ) );
+  if( f == NULL )
+    {
+      perror( "[Antix] checkpoint" );
+      return false;
+    }
+
+  const bool ok( WriteSection( f, &hdr, sizeof(hdr) ) &&
+		 WriteSection( f, world.x.data(), robots * sizeof(real_t) ) &&
+		 WriteSection( f, world.y.data(), robots * sizeof(real_t) ) &&
+		 WriteSection( f, world.a.data(), robots * sizeof(real_t) ) &&
+		 WriteSection( f, world.v.data(), robots * sizeof(real_t) ) &&
+		 WriteSection( f, world.w.data(), robots * sizeof(real_t) ) &&
+		 WriteSection( f, world.held_puck.data(), robots * sizeof(int) ) &&
+		 WriteSection( f, world.cell.data(), robots * sizeof(unsigned int) ) &&
+		 WriteSection( f, world.cell_pos.data(), robots * sizeof(unsigned int) ) &&
+		 WriteSection( f, world.id.data(), robots * sizeof(unsigned int) ) &&
+		 WriteSection( f, puck_records.data(), pucks * sizeof(puck_record_t) ) &&
+		 WriteSection( f, home_records.data(), homes * sizeof(home_record_t) ) &&
+		 WriteSection( f, waiting_ids.data(), waiting_ids.size() * sizeof(unsigned int) ) &&
+		 WriteSection( f, state.data(), state.size() ) );
+
+  if( fclose( f ) != 0 || ! ok )
+    {
+      perror( "[Antix] checkpoint" );
+      unlink( tmp.c_str() );
+      return false;
+    }
+
+  if( rename( tmp.c_str(), Checkpoint::filename ) != 0 )
+    {
+      perror( "[Antix] checkpoint" );
+      return false;
+    }
+
+  return true;
+}
+
+void Checkpoint::Write( bool wait )
+{
+  if( writer )
+    {
+      if( waitpid( writer, NULL, wait ? 0 : WNOHANG ) == 0 )
+	{
+	  printf( "[Antix] checkpoint at update %llu skipped: the last is still being written\n",
+		  (long long unsigned)Robot::updates );
+	  return;
+	}
+      writer = 0;
+    }
+
+  fflush( stdout ); // or the child would print it again
+
+  const pid_t pid( fork() );
+  if( pid < 0 )
+    {
+      perror( "[Antix] checkpoint fork" );
+      return;
+    }
+
+  if( pid == 0 )
+    {
+      // only this thread exists here, and the simulator's exit
+      // handlers are not ours to run
+      _exit( WriteFile() ? 0 : 1 );
+    }
+
+  writer = pid;
+  printf( "[Antix] checkpoint at update %llu to %s\n",
+	  (long long unsigned)Robot::updates, filename );
+
+  if( wait )
+    {
+      int status(0);
+      waitpid( writer, &status, 0 );
+      writer = 0;
+      if( ! WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
+	fprintf( stderr, "[Antix] checkpoint to %s failed\n", filename );
+    }
+}
+
+// check a value in the checkpoint against the world we made
+static void Expect( const char* what, double found, double expected )
+{
+  if( found != expected )
+    {
+      fprintf( stderr, "[Antix] Checkpoint %s has %s %g but this run has %g. Use the options it was written with.\n",
+	       Checkpoint::restore_filename, what, found, expected );
+      exit(-1); // error
+    }
+}
+
+void Checkpoint::Restore()
+{
+  const int fd( open( restore_filename, O_RDONLY ) );
+  struct stat st;
+  if( fd < 0 || fstat( fd, &st ) != 0 )
+    {
+      perror( "[Antix] restore" );
+      exit(-1); // error
+    }
+
+  void* mapped( mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) );
+  if( mapped == MAP_FAILED )
+    {
+      perror( "[Antix] restore" );
+      exit(-1); // error
+    }
+  close( fd );
+
+  const char* p( (const char*)mapped );
+  const header_t* hdr( ReadSection<header_t>( p, 1 ) );
+  if( (size_t)st.st_size < sizeof(header_t) ||
+      memcmp( hdr->magic, MAGIC, sizeof(MAGIC) ) != 0 ||
+      hdr->version != VERSION ||
+      hdr->header_bytes != sizeof(header_t) )
+    {
+      fprintf( stderr, "[Antix] %s is not a version %u checkpoint.\n", restore_filename, VERSION );
+      exit(-1); // error
+    }
+
+  World& world( Robot::world );
+  const unsigned int robots( world.RobotCount() );
+  const unsigned int pucks( world.pucks.size() );
+  const unsigned int homes( Robot::homes.size() );
+
+  Expect( "robots", hdr->robots, robots );
+  Expect( "pucks", hdr->pucks, pucks );
+  Expect( "homes", hdr->homes, homes );
+  Expect( "matrix type", hdr->matrix_type, Robot::matrix_type );
+  Expect( "grid type", hdr->grid_type, Robot::grid_type );
+  Expect( "grid interval", hdr->grid_interval, Robot::grid_interval );
+  Expect( "reorder interval", hdr->reorder_interval, Robot::reorder_interval );
+
+  // a grid that is resized as the run goes carries on at the width it
+  // had reached
+  if( Robot::grid_type == Robot::GRID_FIXED )
+    Expect( "matrix width", hdr->matrixwidth, Robot::matrixwidth );
+  else if( hdr->matrixwidth != Robot::matrixwidth )
+    Robot::Regrid( hdr->matrixwidth );
+  Expect( "teams", hdr->teams, Robot::teams );
+  Expect( "world size", hdr->worldsize, Robot::worldsize );
+  Expect( "seed", hdr->seed, Rng::seed );
+  Expect( "bytes per real", hdr->real_bytes, sizeof(real_t) );
+
+  const size_t expected_bytes( Padded( sizeof(header_t) ) +
+			       5 * Padded( robots * sizeof(real_t) ) +
+			       4 * Padded( robots * sizeof(unsigned int) ) +
+			       Padded( pucks * sizeof(puck_record_t) ) +
+			       Padded( homes * sizeof(home_record_t) ) +
+			       Padded( hdr->waiting * sizeof(unsigned int) ) +
+			       Padded( hdr->state_bytes ) );
+  Expect( "size", st.st_size, expected_bytes );
+
+  // the robots' state is copied straight into the world's arrays
+  memcpy( world.x.data(), ReadSection<real_t>( p, robots ), robots * sizeof(real_t) );
+  memcpy( world.y.data(), ReadSection<real_t>( p, robots ), robots * sizeof(real_t) );
+  memcpy( world.a.data(), ReadSection<real_t>( p, robots ), robots * sizeof(real_t) );
+  memcpy( world.v.data(), ReadSection<real_t>( p, robots ), robots * sizeof(real_t) );
+  memcpy( world.w.data(), ReadSection<real_t>( p, robots ), robots * sizeof(real_t) );
+  memcpy( world.held_puck.data(), ReadSection<int>( p, robots ), robots * sizeof(int) );
+  memcpy( world.cell.data(), ReadSection<unsigned int>( p, robots ), robots * sizeof(unsigned int) );
+  memcpy( world.cell_pos.data(), ReadSection<unsigned int>( p, robots ), robots * sizeof(unsigned int) );
+  memcpy( world.id.data(), ReadSection<unsigned int>( p, robots ), robots * sizeof(unsigned int) );
+  Robot::AssignHandles();
+
+  const puck_record_t* puck_records( ReadSection<puck_record_t>( p, pucks ) );
+  for( unsigned int i(0); i<pucks; i++ )
+    {
+      Puck* puck( world.pucks[i] );
+      const puck_record_t& rec( puck_records[i] );
+      puck->x = rec.x;
+      puck->y = rec.y;
+      puck->delivery_time = rec.delivery_time;
+      puck->home = rec.home < 0 ? NULL : Robot::homes[rec.home];
+      puck->index = rec.index;
+      puck->cell_pos = rec.cell_pos;
+      puck->held = rec.held;
+      puck->wheel_prev = puck->wheel_next = NULL;
+      puck->claim = 0;
+    }
+
+  const home_record_t* home_records( ReadSection<home_record_t>( p, homes ) );
+  for( unsigned int i(0); i<homes; i++ )
+    {
+      Robot::homes[i]->score = home_records[i].score;
+      Robot::homes[i]->pucks = home_records[i].pucks;
+    }
+
+  // the pucks waiting to score go back in the order they were in
+  const unsigned int* waiting_ids( ReadSection<unsigned int>( p, hdr->waiting ) );
+  std::vector<Puck*> waiting( hdr->waiting );
+  for( unsigned int i(0); i<hdr->waiting; i++ )
+    waiting[i] = world.pucks[ waiting_ids[i] ];
+  Home::SetWaitingPucks( waiting );
+
+  // rebuild the matrix cells in their saved order
+  if( Robot::matrix_type != Robot::MATRIX_CSR )
+    {
+      Robot::ClearMatrix();
+
+      for( unsigned int s(0); s<robots; s++ )
+	{
+	  std::vector<unsigned int>& list( Robot::CellAt( world.cell[s] ).robots );
+	  if( list.size() <= world.cell_pos[s] )
+	    list.resize( world.cell_pos[s] + 1 );
+	  list[ world.cell_pos[s] ] = s;
+	}
+
+      for( unsigned int i(0); i<pucks; i++ )
+	{
+	  const Puck* puck( world.pucks[i] );
+	  std::vector<unsigned int>& list( Robot::CellAt( puck->index ).pucks );
+	  if( list.size() <= puck->cell_pos )
+	    list.resize( puck->cell_pos + 1 );
+	  list[ puck->cell_pos ] = i;
+	}
+    }
+
+  for( unsigned int s(0); s<robots; s++ )
+    {
+      Robot* r( world.handle[s] );
+      r->pose = Robot::Pose( world.x[s], world.y[s], world.a[s] );
+      Robot::FovBBox( world.x[s], world.y[s], world.a[s], world.sensor_bbox[s] );
+    }
+
+  // the controllers' state, read in place from the mapping
+  const char* state( ReadSection<char>( p, hdr->state_bytes ) );
+  const char* in( state );
+  for( unsigned int s(0); s<robots; s++ )
+    world.handle[s]->Load( in );
+  FOR_EACH( h, Robot::homes )
+    if( (*h)->team )
+      (*h)->team->LoadState( in );
+
+  if( in != state + hdr->state_bytes )
+    {
+      fprintf( stderr, "[Antix] Checkpoint %s has controller state for different controllers.\n",
+	       restore_filename );
+      exit(-1); // error
+    }
+
+  Robot::updates = hdr->updates;
+
+  printf( "[Antix] restored update %llu from %s\n", (long long unsigned)Robot::updates, restore_filename );
+
+  munmap( mapped, st.st_size );
+}
@@ -12,11 +12,14 @@ using namespace Antix;
 Forager::Forager( Antix::Home* h ) 
   : Robot( h, Pose() ), 
     lastx(home->x), // initial search location is close to my home
-    lasty(home->y)
+    lasty(home->y),
+    pickx(0),
+    picky(0),
+    was_holding(false)
 {
   double delta( 4.0 );
-  DistanceNormalize( pose.x = delta * drand48() -delta/2.0 + home->x );
-  DistanceNormalize( pose.y = delta * drand48() -delta/2.0 + home->y );
+  DistanceNormalize( pose.x = delta * Rng::Uniform( Rng::STREAM_ROBOT, slot, Rng::SETUP, 0 ) -delta/2.0 + home->x );
+  DistanceNormalize( pose.y = delta * Rng::Uniform( Rng::STREAM_ROBOT, slot, Rng::SETUP, 1 ) -delta/2.0 + home->y );
   
 //   static bool startup( true );
 
@@ -40,13 +43,23 @@ void Forager::Controller()
   double da( fast_atan2( dy, dx ));
   double dist( hypot( dx, dy ));
   
+  // A pickup asked for last time worked, so remember where it was. A
+  // pickup in parallel is only a claim, which another robot may win,
+  // so this waits until the puck is held.
+  if( Holding() && !was_holding )
+    {
+      lastx = pickx;
+      lasty = picky;
+    }
+  was_holding = Holding();
+  
   if( Holding() )
     { // drive home		  
       // turn towards home		  
       heading_error = AngleNormalize( da - pose.a );// < 0  ? 0.05 : -0.05;
       
       // if we're some random distance inside the home radius
-      if( dist < drand48() * home->r )
+      if( dist < Random() * home->r )
 	Drop(); // release the puck (implies we won't be holding
       // next time round)
     }
@@ -59,19 +72,19 @@ void Forager::Controller()
 	  double closest_range(1e9); //BIG				
 	  FOR_EACH( it, see_pucks )
 	    {
-	      if( it->range < closest_range && !it->held  )						 
+	      if( it->range < closest_range && !it->Held()  )						 
 		{
 		  heading_error = it->bearing;
 		  closest_range = it->range; // remember the closest range so far
 		}
 		}
 	      
-	      // and attempt to pick something up
+	      // and attempt to pick something up, noting where in case
+	      // it works
 	      if( Pickup() )
 		{
-		  // got one! remember where it was
-		  lastx = pose.x;
-		  lasty = pose.y;
+		  pickx = pose.x;
+		  picky = pose.y;
 		}
 	    }
 	  else
@@ -86,8 +99,8 @@ void Forager::Controller()
 	      // puck, choose another place 
 	      if( hypot( lx,ly ) < 0.05 )
 		{
-		  lastx += drand48() * 1.0 - 0.5;
-		  lasty += drand48() * 1.0 - 0.5;
+		  lastx += Random() * 1.0 - 0.5;
+		  lasty += Random() * 1.0 - 0.5;
 		  
 		  DistanceNormalize( lastx );
 		  DistanceNormalize( lasty );
@@ -108,3 +121,149 @@ void Forager::Controller()
 	}		
     }
   
+void Forager::SaveState( std::vector<char>& out ) const
+{
+  Checkpoint::Put( out, lastx );
+  Checkpoint::Put( out, lasty );
+  Checkpoint::Put( out, pickx );
+  Checkpoint::Put( out, picky );
+  Checkpoint::Put( out, was_holding );
+}
+
+void Forager::LoadState( const char*& in )
+{
+  Checkpoint::Get( in, lastx );
+  Checkpoint::Get( in, lasty );
+  Checkpoint::Get( in, pickx );
+  Checkpoint::Get( in, picky );
+  Checkpoint::Get( in, was_holding );
+}
+
+ForagerTeam::ForagerTeam( Antix::Home* h )
+  : Team( h ),
+    lastx( slots.size(), home->x ), // initial search location is close to my home
+    lasty( slots.size(), home->y ),
+    pickx( slots.size() ),
+    picky( slots.size() ),
+    was_holding( slots.size(), false ),
+    dist( slots.size() ),
+    da( slots.size() ),
+    heading_error( slots.size() )
+{
+}
+
+void ForagerTeam::Control()
+{
+  const unsigned int n( slots.size() );
+  
+  // distance and angle to home
+  for( unsigned int i(0); i<n; i++ )
+    {
+      const double dx( Robot::WrapDistance( home->x - x[i] ));
+      const double dy( Robot::WrapDistance( home->y - y[i] ));
+      da[i] = fast_atan2( dy, dx );
+      dist[i] = hypot( dx, dy );
+    }
+  
+  for( unsigned int i(0); i<n; i++ )
+    {
+      // a pickup asked for last time worked, so remember where it was
+      if( holding[i] && !was_holding[i] )
+	{
+	  lastx[i] = pickx[i];
+	  lasty[i] = picky[i];
+	}
+      was_holding[i] = holding[i];
+      
+      action[i] = ACTION_NONE;
+      heading_error[i] = 0.0;
+      
+      if( holding[i] )
+	{ // drive home		  
+	  // turn towards home		  
+	  heading_error[i] = Robot::AngleNormalize( da[i] - a[i] );
+	  
+	  // if we're some random distance inside the home radius
+	  if( dist[i] < robots[i]->Random() * home->r )
+	    action[i] = ACTION_DROP; // release the puck
+	  continue;
+	}
+      
+      const SenseView<Robot::SeePuck>& see_pucks( robots[i]->see_pucks );
+      
+      // if I see any pucks and I'm away from home
+      if( see_pucks.size() > 0 && dist[i] > home->r )
+	{
+	  // find the angle to the closest puck that is not being carried
+	  double closest_range(1e9); //BIG				
+	  bool reachable( false );
+	  FOR_EACH( it, see_pucks )
+	    {
+	      if( it->range < closest_range && !it->Held()  )						 
+		{
+		  heading_error[i] = it->bearing;
+		  closest_range = it->range; // remember the closest range so far
+		}
+	      
+	      if( it->range < Robot::pickup_range && !it->GetPuck()->held )
+		reachable = true;
+	    }
+	  
+	  // and attempt to pick something up if there's anything close
+	  // enough, noting where in case it works. Checking here saves
+	  // visiting the robot again when nothing is.
+	  if( reachable )
+	    {
+	      action[i] = ACTION_PICKUP;
+	      pickx[i] = x[i];
+	      picky[i] = y[i];
+	    }
+	}
+      else
+	{
+	  double lx( Robot::WrapDistance( lastx[i] - x[i] ));	 	 
+	  double ly( Robot::WrapDistance( lasty[i] - y[i] ));		  
+	  
+	  // go towards the last place I picked up a puck
+	  heading_error[i] = Robot::AngleNormalize( fast_atan2(ly, lx) - a[i] );
+	  
+	  // if I've arrived at the last place and not yet found a
+	  // puck, choose another place 
+	  if( hypot( lx,ly ) < 0.05 )
+	    {
+	      lastx[i] += robots[i]->Random() * 1.0 - 0.5;
+	      lasty[i] += robots[i]->Random() * 1.0 - 0.5;
+	      
+	      Robot::DistanceNormalize( lastx[i] );
+	      Robot::DistanceNormalize( lasty[i] );
+	    }
+	}
+    }
+  
+  // if I'm pointing in about the right direction drive fast,
+  // otherwise drive slowly and turn to reduce the error
+  for( unsigned int i(0); i<n; i++ )
+    {
+      const bool aligned( fabs( heading_error[i] ) < 0.1 );
+      v[i] = aligned ? 0.005 : 0.001;
+      w[i] = aligned ? 0.0 : 0.2 * heading_error[i];
+    }
+}
+
+void ForagerTeam::SaveState( std::vector<char>& out ) const
+{
+  Checkpoint::Put( out, lastx );
+  Checkpoint::Put( out, lasty );
+  Checkpoint::Put( out, pickx );
+  Checkpoint::Put( out, picky );
+  Checkpoint::Put( out, was_holding );
+}
+
+void ForagerTeam::LoadState( const char*& in )
+{
+  Checkpoint::Get( in, lastx );
+  Checkpoint::Get( in, lasty );
+  Checkpoint::Get( in, pickx );
+  Checkpoint::Get( in, picky );
+  Checkpoint::Get( in, was_holding );
+}
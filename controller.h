@@ -6,11 +6,35 @@
 class Forager : public Antix::Robot
 {
  public:  
-  double lastx, lasty;  
+  double lastx, lasty; // where I last picked up a puck
+  double pickx, picky; // where I last tried to pick one up
+  bool was_holding; // holding as of the last update
   
   Forager( Antix::Home* h );
   
   // must implement this method. Examine the pixels vector and set the
   // speed sensibly.
   virtual void Controller();
+
+  virtual void SaveState( std::vector<char>& out ) const;
+  virtual void LoadState( const char*& in );
+};
+
+// the same controller for a whole home's robots at once
+class ForagerTeam : public Antix::Team
+{
+ public:
+  std::vector<double> lastx, lasty; // where each robot last picked up a puck
+  std::vector<double> pickx, picky; // where each robot last tried to pick one up
+  std::vector<char> was_holding; // holding as of the last update
+  
+  // scratch space, one entry per robot
+  std::vector<double> dist, da, heading_error;
+  
+  ForagerTeam( Antix::Home* h );
+  
+  virtual void Control();
+
+  virtual void SaveState( std::vector<char>& out ) const;
+  virtual void LoadState( const char*& in );
 };
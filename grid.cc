@@ -0,0 +1,540 @@
+/****
+     grid.cc
+     version 1
+     Compressed sparse row matrix, rebuilt every update, the sparse
+     matrix, and the sizing and subdivision of the matrix's cells
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <algorithm>
+#include "antix.h"
+using namespace Antix;
+
+// offset of the first robot and puck in each thread's block of cells
+static std::vector<unsigned int> robot_block_start, puck_block_start;
+
+// Each thread owns a fixed share of the robots, pucks and cells while
+// rebuilding, so that the counts written in one pass are found by the
+// same thread in the next.
+static inline unsigned int ShareStart( unsigned int count, unsigned int share )
+{
+  return( (uint64_t)count * share / Pool::threads );
+}
+
+// count the robots and pucks in each cell, per thread
+static void CountChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  World& world( Robot::world );
+  Robot::MatrixCSR& csr( Robot::csr );
+  const unsigned int cells( Robot::matrixwidth * Robot::matrixwidth );
+
+  for( unsigned int t(first); t<last; t++ )
+    {
+      unsigned int* rcount( &csr.robot_count[ t * cells ] );
+      unsigned int* pcount( &csr.puck_count[ t * cells ] );
+      std::fill( rcount, rcount + cells, 0 );
+      std::fill( pcount, pcount + cells, 0 );
+
+      const unsigned int robots( world.RobotCount() );
+      for( unsigned int i(ShareStart(robots,t)); i<ShareStart(robots,t+1); i++ )
+	rcount[ world.cell[i] ]++;
+
+      const unsigned int pucks( world.pucks.size() );
+      for( unsigned int i(ShareStart(pucks,t)); i<ShareStart(pucks,t+1); i++ )
+	{
+	  Puck* p( world.pucks[i] );
+	  p->index = Robot::Cell( p->x, p->y );
+	  pcount[ p->index ]++;
+	}
+    }
+}
+
+// total the counts over a range of cells
+static void TotalChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  Robot::MatrixCSR& csr( Robot::csr );
+  const unsigned int cells( Robot::matrixwidth * Robot::matrixwidth );
+
+  for( unsigned int b(first); b<last; b++ )
+    {
+      unsigned int robots(0), pucks(0);
+      for( unsigned int c(ShareStart(cells,b)); c<ShareStart(cells,b+1); c++ )
+	for( unsigned int t(0); t<Pool::threads; t++ )
+	  {
+	    robots += csr.robot_count[ t * cells + c ];
+	    pucks += csr.puck_count[ t * cells + c ];
+	  }
+
+      // the block totals, turned into offsets by the caller
+      robot_block_start[b] = robots;
+      puck_block_start[b] = pucks;
+    }
+}
+
+// turn the counts into the position each thread writes its next item
+// in each cell, starting from the block offsets computed by the caller
+static void OffsetChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  Robot::MatrixCSR& csr( Robot::csr );
+  const unsigned int cells( Robot::matrixwidth * Robot::matrixwidth );
+
+  for( unsigned int b(first); b<last; b++ )
+    {
+      unsigned int robots( robot_block_start[b] ), pucks( puck_block_start[b] );
+      for( unsigned int c(ShareStart(cells,b)); c<ShareStart(cells,b+1); c++ )
+	{
+	  csr.robot_start[c] = robots;
+	  csr.puck_start[c] = pucks;
+
+	  for( unsigned int t(0); t<Pool::threads; t++ )
+	    {
+	      unsigned int& rc( csr.robot_count[ t * cells + c ] );
+	      unsigned int& pc( csr.puck_count[ t * cells + c ] );
+	      const unsigned int rn( rc ), pn( pc );
+	      rc = robots;
+	      pc = pucks;
+	      robots += rn;
+	      pucks += pn;
+	    }
+	}
+    }
+}
+
+// write each thread's robots and pucks into their cells
+static void ScatterChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  World& world( Robot::world );
+  Robot::MatrixCSR& csr( Robot::csr );
+  const unsigned int cells( Robot::matrixwidth * Robot::matrixwidth );
+
+  for( unsigned int t(first); t<last; t++ )
+    {
+      unsigned int* rnext( &csr.robot_count[ t * cells ] );
+      unsigned int* pnext( &csr.puck_count[ t * cells ] );
+
+      const unsigned int robots( world.RobotCount() );
+      for( unsigned int i(ShareStart(robots,t)); i<ShareStart(robots,t+1); i++ )
+	csr.robots[ rnext[ world.cell[i] ]++ ] = i;
+
+      const unsigned int pucks( world.pucks.size() );
+      for( unsigned int i(ShareStart(pucks,t)); i<ShareStart(pucks,t+1); i++ )
+	csr.pucks[ pnext[ world.pucks[i]->index ]++ ] = i;
+    }
+}
+
+void Robot::MatrixCSR::Rebuild()
+{
+  const unsigned int cells( matrixwidth * matrixwidth );
+  const unsigned int threads( Pool::threads );
+
+  // fast on subsequent calls
+  robot_count.resize( threads * cells );
+  puck_count.resize( threads * cells );
+  robot_start.resize( cells + 1 );
+  puck_start.resize( cells + 1 );
+  robots.resize( world.RobotCount() );
+  pucks.resize( world.pucks.size() );
+  robot_block_start.resize( threads );
+  puck_block_start.resize( threads );
+
+  Pool::ParallelFor( threads, CountChunk, 1 );
+  Pool::ParallelFor( threads, TotalChunk, 1 );
+
+  // prefix sum of the block totals
+  unsigned int rsum(0), psum(0);
+  for( unsigned int b(0); b<threads; b++ )
+    {
+      const unsigned int rn( robot_block_start[b] ), pn( puck_block_start[b] );
+      robot_block_start[b] = rsum;
+      puck_block_start[b] = psum;
+      rsum += rn;
+      psum += pn;
+    }
+
+  Pool::ParallelFor( threads, OffsetChunk, 1 );
+  robot_start[cells] = rsum;
+  puck_start[cells] = psum;
+
+  Pool::ParallelFor( threads, ScatterChunk, 1 );
+}
+
+unsigned int Robot::MatrixSparse::Occupied() const
+{
+  unsigned int cells(0);
+  FOR_EACH( it, partitions )
+    cells += it->size();
+  return cells;
+}
+
+double Robot::DenseMatrixBytes( unsigned int width )
+{
+  const double cells( (double)width * width );
+  if( matrix_type == MATRIX_CELLS )
+    return( cells * sizeof(MatrixCell) );
+  if( matrix_type == MATRIX_CSR )
+    return( cells * (2 + 2 * threads) * sizeof(unsigned int) ); // starts and per-thread counts
+  return 0;
+}
+
+void Robot::ClearMatrix()
+{
+  if( matrix_type == MATRIX_SPARSE )
+    FOR_EACH( it, sparse.partitions )
+      it->clear();
+  else if( matrix_type == MATRIX_CELLS )
+    matrix.assign( matrixwidth * matrixwidth, MatrixCell() );
+}
+
+Robot::grid_type_t Robot::grid_type( Robot::GRID_FIXED );
+unsigned int Robot::grid_interval( 100 );
+std::vector<Robot::Subgrid> Robot::subgrids;
+unsigned int Robot::hot_cells( 0 );
+std::vector<int> Robot::cell_subgrid;
+
+// The cost of visiting a cell, relative to testing one robot or puck
+// in it against a sensor. Visiting a cell means finding its lists and
+// padding a block for the vector kernel, which costs about as much
+// as testing a few candidates.
+static const double CELL_COST( 8.0 );
+
+// headings sampled to find the mean size of a field of view
+static const unsigned int HEADINGS( 64 );
+
+// the finest matrix tried has cells this many times narrower than
+// the sensor range
+static const unsigned int MAX_SPLIT( 8 );
+
+// a cell near a home holding at least this many robots and pucks is
+// split, into subcells holding about SUBCELL_ITEMS each, but no more
+// than MAX_SIDE to a side
+static const unsigned int HOT_ITEMS( 48 );
+static const unsigned int SUBCELL_ITEMS( 8 );
+static const unsigned int MAX_SIDE( 8 );
+
+// the cells overlapping a home, which are the only ones split
+static std::vector<unsigned int> home_cells;
+static unsigned int home_cells_width( 0 ); // the matrix width home_cells was found for
+
+// the expected cost of one robot's sensing with cells d wide, for a
+// field of view whose bounding box is bx by by, among robots and
+// pucks at this density per unit area
+static double SenseCost( double d, double bx, double by, double density )
+{
+  const double cells( (bx / d + 1.0) * (by / d + 1.0) );
+  const double candidates( density * (bx + d) * (by + d) );
+  return( CELL_COST * cells + candidates );
+}
+
+void Robot::TuneGrid()
+{
+  // the mean size of a field of view's bounding box
+  double bx(0), by(0);
+  for( unsigned int i(0); i<HEADINGS; i++ )
+    {
+      bbox_t box;
+      FovBBox( 0, 0, 2.0 * M_PI * i / HEADINGS - M_PI, box );
+      bx += box.x.max - box.x.min;
+      by += box.y.max - box.y.min;
+    }
+  bx /= HEADINGS;
+  by /= HEADINGS;
+
+  const unsigned int robots( world.RobotCount() );
+  const unsigned int pucks( world.pucks.size() );
+  double density( (robots + pucks) / (worldsize * worldsize) );
+
+  // How crowded it is where the robots are: the robots and pucks per
+  // unit area in each robot's cell, averaged over the robots. A
+  // hierarchical grid splits the crowded cells instead, so sizes the
+  // rest for the mean density.
+  if( grid_type == GRID_AUTO && robots )
+    {
+      double crowding(0);
+      if( matrix_type == MATRIX_SPARSE )
+	{
+	  // only the occupied cells are stored, and the rest add nothing
+	  FOR_EACH( table, sparse.partitions )
+	    FOR_EACH( it, *table )
+	      crowding += (double)it->second.robots.size() *
+		(it->second.robots.size() + it->second.pucks.size());
+	}
+      else
+	{
+	  const unsigned int cells( matrixwidth * matrixwidth );
+	  std::vector<unsigned int> robot_counts( cells ), puck_counts( cells );
+	  for( unsigned int s(0); s<robots; s++ )
+	    robot_counts[ world.cell[s] ]++;
+	  for( unsigned int i(0); i<pucks; i++ )
+	    puck_counts[ world.pucks[i]->index ]++;
+
+	  for( unsigned int c(0); c<cells; c++ )
+	    crowding += (double)robot_counts[c] * (robot_counts[c] + puck_counts[c]);
+	}
+
+      const double d( worldsize / matrixwidth );
+      density = crowding / (robots * d * d);
+    }
+
+  // From cells a few times wider than the sensor range to a few times
+  // narrower, with no more cells than there are robots and pucks,
+  // pick the cheapest that a dense matrix has room for. Keep the
+  // current width unless another is clearly better, so the matrix
+  // isn't rebuilt for nothing.
+  const unsigned int base( std::max( 1.0, floor( worldsize / range ) ) );
+  const unsigned int most( std::max( base, (unsigned int)sqrt( 4.0 * (robots + pucks) ) ) );
+  unsigned int best( matrixwidth );
+  double best_cost( 0.9 * SenseCost( worldsize / matrixwidth, bx, by, density ) );
+  for( unsigned int w( std::max( 1u, base / 4 ) ); w <= std::min( most, base * MAX_SPLIT ); w++ )
+    {
+      if( DenseMatrixBytes( w ) > matrix_budget )
+	break;
+
+      const double cost( SenseCost( worldsize / w, bx, by, density ) );
+      if( cost < best_cost )
+	{
+	  best = w;
+	  best_cost = cost;
+	}
+    }
+
+  if( best != matrixwidth )
+    {
+      printf( "[Antix] grid %u cells wide at update %llu\n", best, (long long unsigned)updates );
+      Regrid( best );
+    }
+}
+
+void Robot::Regrid( unsigned int width )
+{
+  matrixwidth = width;
+
+  // a CSR matrix is rebuilt from the robots' cells and the pucks'
+  // positions in the pose phase
+  const unsigned int robots( world.RobotCount() );
+  for( unsigned int s(0); s<robots; s++ )
+    world.cell[s] = Cell( world.x[s], world.y[s] );
+
+  if( matrix_type != MATRIX_CSR )
+    {
+      ClearMatrix();
+      for( unsigned int s(0); s<robots; s++ )
+	CellAt( world.cell[s] ).AddRobot( s );
+
+      // a carried puck lives in its robot's cell
+      FOR_EACH( it, world.pucks )
+	if( ! (*it)->held )
+	  {
+	    (*it)->index = Cell( (*it)->x, (*it)->y );
+	    CellAt( (*it)->index ).AddPuck( (*it)->id );
+	  }
+
+      for( unsigned int s(0); s<robots; s++ )
+	if( world.held_puck[s] >= 0 )
+	  {
+	    Puck* puck( world.pucks[ world.held_puck[s] ] );
+	    puck->index = world.cell[s];
+	    CellAt( puck->index ).AddPuck( puck->id );
+	  }
+    }
+
+  hot_cells = 0;
+  cell_subgrid.clear();
+}
+
+// list the cells overlapping any home, in order
+static void FindHomeCells()
+{
+  const unsigned int width( Robot::matrixwidth );
+  home_cells.clear();
+
+  FOR_EACH( it, Robot::homes )
+    {
+      const Home* h( *it );
+      const int lastx( Robot::CellNoWrap( h->x + h->r ) );
+      const int lasty( Robot::CellNoWrap( h->y + h->r ) );
+      for( int x( Robot::CellNoWrap( h->x - h->r ) ); x<=lastx; x++ )
+	for( int y( Robot::CellNoWrap( h->y - h->r ) ); y<=lasty; y++ )
+	  home_cells.push_back( Robot::CellWrap(x) + Robot::CellWrap(y) * width );
+    }
+
+  // homes may share cells
+  std::sort( home_cells.begin(), home_cells.end() );
+  home_cells.erase( std::unique( home_cells.begin(), home_cells.end() ), home_cells.end() );
+
+  home_cells_width = width;
+}
+
+// the subcell of a point in a cell whose corner is at (x0,y0), each
+// subcell sd wide. Points just outside the cell go in its edge.
+static inline unsigned int SubcellIndex( double x, double y, double x0, double y0, double sd, unsigned int side )
+{
+  const int i( std::min( (int)side - 1, std::max( 0, (int)floor( (x - x0) / sd ) ) ) );
+  const int j( std::min( (int)side - 1, std::max( 0, (int)floor( (y - y0) / sd ) ) ) );
+  return( i + j * side );
+}
+
+// a counting sort of ids by subcell, keeping their order within each
+static void SortIntoSubcells( const unsigned int* begin, const unsigned int* end,
+			      const std::vector<unsigned int>& subcell,
+			      std::vector<unsigned int>& start, std::vector<unsigned int>& out )
+{
+  const unsigned int n( end - begin );
+  std::fill( start.begin(), start.end(), 0 );
+  for( unsigned int i(0); i<n; i++ )
+    start[ subcell[i] + 1 ]++;
+  for( unsigned int k(1); k<start.size(); k++ )
+    start[k] += start[k-1];
+
+  // start[k] is advanced past subcell k's entries as they are placed,
+  // then moved back
+  out.resize( n );
+  for( unsigned int i(0); i<n; i++ )
+    out[ start[ subcell[i] ]++ ] = begin[i];
+  for( unsigned int k(start.size() - 1); k>0; k-- )
+    start[k] = start[k-1];
+  start[0] = 0;
+}
+
+void Robot::Subgrid::Rebuild()
+{
+  const double d( worldsize / matrixwidth );
+  const double sd( d / side );
+  const double x0( (cell % matrixwidth) * d );
+  const double y0( (cell / matrixwidth) * d );
+  const unsigned int subcells( side * side );
+
+  robot_start.resize( subcells + 1 );
+  puck_start.resize( subcells + 1 );
+
+  const unsigned int *begin, *end;
+
+  CellRobots( cell, begin, end );
+  subcell.resize( end - begin );
+  for( unsigned int i(0); i<subcell.size(); i++ )
+    subcell[i] = SubcellIndex( world.x[begin[i]], world.y[begin[i]], x0, y0, sd, side );
+  SortIntoSubcells( begin, end, subcell, robot_start, robots );
+
+  CellPucks( cell, begin, end );
+  subcell.resize( end - begin );
+  for( unsigned int i(0); i<subcell.size(); i++ )
+    {
+      const Puck* p( world.pucks[begin[i]] );
+      subcell[i] = SubcellIndex( p->x, p->y, x0, y0, sd, side );
+    }
+  SortIntoSubcells( begin, end, subcell, puck_start, pucks );
+}
+
+static void SubgridChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  for( unsigned int i(first); i<last; i++ )
+    Robot::subgrids[i].Rebuild();
+}
+
+// the subgrid of a cell, or -1 if it isn't hot
+static inline int HotSubgrid( unsigned int cell )
+{
+  if( Robot::hot_cells == 0 )
+    return -1;
+
+  if( ! Robot::cell_subgrid.empty() )
+    return Robot::cell_subgrid[cell];
+
+  // a sparse matrix has no room for an entry per cell, but the hot
+  // cells are few and in order
+  unsigned int lo(0), hi( Robot::hot_cells );
+  while( lo < hi )
+    {
+      const unsigned int mid( (lo + hi) / 2 );
+      if( Robot::subgrids[mid].cell < cell )
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return( lo < Robot::hot_cells && Robot::subgrids[lo].cell == cell ? (int)lo : -1 );
+}
+
+void Robot::RebuildSubgrids()
+{
+  const bool dense( matrix_type != MATRIX_SPARSE );
+  if( home_cells_width != matrixwidth ||
+      (dense && cell_subgrid.size() != matrixwidth * matrixwidth) )
+    {
+      FindHomeCells();
+      if( dense )
+	cell_subgrid.assign( matrixwidth * matrixwidth, -1 );
+      hot_cells = 0;
+    }
+
+  // last update's hot cells may have cooled down
+  if( dense )
+    for( unsigned int i(0); i<hot_cells; i++ )
+      cell_subgrid[ subgrids[i].cell ] = -1;
+  hot_cells = 0;
+
+  FOR_EACH( c, home_cells )
+    {
+      const unsigned int *rb, *re, *pb, *pe;
+      CellRobots( *c, rb, re );
+      CellPucks( *c, pb, pe );
+      const unsigned int items( (re - rb) + (pe - pb) );
+      if( items < HOT_ITEMS )
+	continue;
+
+      if( hot_cells == subgrids.size() )
+	subgrids.push_back( Subgrid() );
+
+      Subgrid& g( subgrids[hot_cells] );
+      g.cell = *c;
+      g.side = std::min( MAX_SIDE, (unsigned int)ceil( sqrt( (double)items / SUBCELL_ITEMS ) ) );
+      if( dense )
+	cell_subgrid[*c] = hot_cells;
+      hot_cells++;
+    }
+
+  Pool::ParallelFor( hot_cells, SubgridChunk, 1 );
+}
+
+void Robot::QuerySpans( const bbox_t& box, std::vector<Span>& out )
+{
+  out.clear();
+
+  const double d( worldsize / matrixwidth );
+  const int lastx( CellNoWrap(box.x.max) );
+  const int lasty( CellNoWrap(box.y.max) );
+
+  for( int x(CellNoWrap(box.x.min)); x<=lastx; x++ )
+    for( int y(CellNoWrap(box.y.min)); y<=lasty; y++ )
+      {
+	Span span;
+	span.cell = CellWrap(x) + ( CellWrap(y) * matrixwidth );
+
+	const int hot( HotSubgrid( span.cell ) );
+	if( hot < 0 )
+	  {
+	    CellRobots( span.cell, span.robots_begin, span.robots_end );
+	    CellPucks( span.cell, span.pucks_begin, span.pucks_end );
+	    out.push_back( span );
+	    continue;
+	  }
+
+	// only the subcells the box overlaps, measured from this
+	// cell's corner without wrapping, as the box is
+	const Subgrid& g( subgrids[hot] );
+	const double sd( d / g.side );
+	const unsigned int first( SubcellIndex( box.x.min, box.y.min, x * d, y * d, sd, g.side ) );
+	const unsigned int last( SubcellIndex( box.x.max, box.y.max, x * d, y * d, sd, g.side ) );
+
+	// the subcells of a row are stored together, so each row the box
+	// overlaps is one span
+	for( unsigned int j( first / g.side ); j <= last / g.side; j++ )
+	  {
+	    const unsigned int k( first % g.side + j * g.side );
+	    const unsigned int end( last % g.side + j * g.side + 1 );
+	    span.robots_begin = g.robots.data() + g.robot_start[k];
+	    span.robots_end = g.robots.data() + g.robot_start[end];
+	    span.pucks_begin = g.pucks.data() + g.puck_start[k];
+	    span.pucks_end = g.pucks.data() + g.puck_start[end];
+	    out.push_back( span );
+	  }
+      }
+}
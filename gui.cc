@@ -3,8 +3,11 @@
 using namespace Antix;
 
 #if GRAPHICS
-#include <GLUT/glut.h> // OS X users need <glut/glut.h> instead
-#include "gltzpr/zpr.h" // zoom-pan-rotate GLUT utility
+#ifdef __APPLE__
+#include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
 
 int Robot::winsize( 700 );
 
@@ -20,7 +23,10 @@ static bool zooming(false);
 // to process
 static void idle_func( void )
 {
-  Robot::UpdateAll();
+  if( Replay::filename )
+    Replay::Update();
+  else
+    Robot::UpdateAll();
 }
 
 static void timer_func( int dummy )
@@ -56,6 +62,51 @@ static void mouse_func(int button, int state, int x, int y)
     }
 }
 
+static void keyboard_func( unsigned char key, int x, int y )
+{
+  switch( key )
+    {
+    case ' ':
+      Robot::paused = !Robot::paused;
+      break;
+
+    case '+':
+    case '=':
+      Replay::rate *= 2.0;
+      break;
+
+    case '-':
+      Replay::rate /= 2.0;
+      break;
+    }
+}
+
+// moving about a recording
+static void special_func( int key, int x, int y )
+{
+  if( ! Replay::filename )
+    return;
+
+  switch( key )
+    {
+    case GLUT_KEY_LEFT:
+      Replay::Skip( -0.05 );
+      break;
+
+    case GLUT_KEY_RIGHT:
+      Replay::Skip( 0.05 );
+      break;
+
+    case GLUT_KEY_HOME:
+      Replay::Seek( 0 );
+      break;
+
+    case GLUT_KEY_END:
+      Replay::Seek( ~0ULL );
+      break;
+    }
+}
+
 static void motion_func( int x, int y) 
 {  
   if( zooming )
@@ -105,6 +156,8 @@ void Robot::InitGraphics( int argc, char* argv[] )
   glutTimerFunc( gui_interval, timer_func, 0 );
   glutMouseFunc( mouse_func );
   glutMotionFunc( motion_func );
+  glutKeyboardFunc( keyboard_func );
+  glutSpecialFunc( special_func );
   glutIdleFunc( idle_func );
   glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
   glEnable( GL_BLEND );
@@ -152,7 +205,7 @@ void Robot::DrawAll()
   // if robots are smaller than 4 pixels across, draw them as points
   if( (radius * (double)winsize/(double)worldsize) < 2.0 )
     {
-      const size_t len( population.size() );
+      const size_t len( world.RobotCount() );
       // keep this buffer around between calls for speed
       static std::vector<GLfloat> pts;	
       static std::vector<GLfloat> colors;	
@@ -166,10 +219,10 @@ void Robot::DrawAll()
 			
       for( unsigned int i(0); i<len; ++i )
 	{
-	  pts[2*i+0] = population[i]->pose.x;
-	  pts[2*i+1] = population[i]->pose.y;
+	  pts[2*i+0] = world.x[i];
+	  pts[2*i+1] = world.y[i];
 
-	  Home::Color& col = population[i]->home->color;
+	  Home::Color& col = homes[world.home_id[i]]->color;
 	  colors[3*i+0] = col.r;
 	  colors[3*i+1] = col.g;
 	  colors[3*i+2] = col.b;
@@ -234,8 +287,7 @@ void Robot::DrawAll()
 
   glColor3f( 1,0,0 ); // red
 	
-  FOR_EACH( c, matrix )
-    FOR_EACH( p, c->pucks )
+  FOR_EACH( p, world.pucks )
     {
       pts.push_back( (*p)->x );
       pts.push_back( (*p)->y );
@@ -269,8 +321,8 @@ void Robot::Draw()
   glPushMatrix();
 
   // shift into this robot's local coordinate frame
-  glTranslatef( pose.x, pose.y, 0 );
-  glRotatef( rtod(pose.a), 0,0,1 );
+  glTranslatef( world.x[slot], world.y[slot], 0 );
+  glRotatef( rtod(world.a[slot]), 0,0,1 );
   
   glColor3f( home->color.r, home->color.g, home->color.b ); 
 	
@@ -337,8 +389,11 @@ void Robot::Draw()
   glPopMatrix();
 
   if( Robot::show_data )
-    glRectf( sensor_bbox.x.min, sensor_bbox.y.min,
-	     sensor_bbox.x.max, sensor_bbox.y.max );
+    {
+      const bbox_t& sensor_bbox( world.sensor_bbox[slot] );
+      glRectf( sensor_bbox.x.min, sensor_bbox.y.min,
+	       sensor_bbox.x.max, sensor_bbox.y.max );
+    }
   
 #if DEBUGVIS
   
@@ -347,8 +402,8 @@ void Robot::Draw()
       glColor3f( 1,1,0 );
       
       double ep( Robot::range );      
-      glRectf( pose.x+ep, pose.y+ep,
-	       pose.x-ep, pose.y-ep );
+      glRectf( world.x[slot]+ep, world.y[slot]+ep,
+	       world.x[slot]-ep, world.y[slot]-ep );
       
       ep = Robot::radius;
       
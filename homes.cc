@@ -0,0 +1,126 @@
+/****
+     homes.cc
+     version 1
+     Grid of homes for finding the home at, or nearest to, a point
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <algorithm>
+#include "antix.h"
+using namespace Antix;
+
+// Each home is filed in the grid cell containing its centre. Cells
+// are at least as wide as the largest home, so a home containing a
+// point has its centre in the point's cell or one of its eight
+// neighbours.
+static std::vector<std::vector<Home*> > grid; // homes in each cell, in order of id
+static unsigned int grid_width(0);
+static double cell_size(0);
+static unsigned int indexed(0); // number of homes in the grid
+
+static inline unsigned int GridCoord( double d )
+{
+  const int c( floor( d / cell_size ) );
+  return( std::min( std::max( c, 0 ), (int)grid_width - 1 ) );
+}
+
+static inline unsigned int GridWrap( int c )
+{
+  return( (c % (int)grid_width + grid_width) % grid_width );
+}
+
+void Home::Index()
+{
+  const std::vector<Home*>& homes( Robot::homes );
+
+  double max_r(0);
+  FOR_EACH( h, homes )
+    max_r = std::max( max_r, (*h)->r );
+
+  // about one home per cell, but no narrower than a home
+  const double side( ceil( sqrt( (double)std::max( 1u, (unsigned int)homes.size() ) ) ) );
+  cell_size = std::max( max_r, Robot::worldsize / side );
+  grid_width = std::max( 1, (int)floor( Robot::worldsize / cell_size ) );
+
+  // with fewer than three cells a side, neighbours would repeat
+  if( grid_width < 3 )
+    grid_width = 1;
+  cell_size = Robot::worldsize / grid_width;
+
+  grid.clear();
+  grid.resize( grid_width * grid_width );
+  FOR_EACH( h, homes )
+    grid[ GridCoord( (*h)->x ) + GridCoord( (*h)->y ) * grid_width ].push_back( *h );
+
+  indexed = homes.size();
+}
+
+static inline double WrapRange( const Home* h, double x, double y )
+{
+  return( hypot( Robot::WrapDistance( h->x - x ), Robot::WrapDistance( h->y - y ) ) );
+}
+
+Home* Home::Containing( double x, double y )
+{
+  assert( indexed == Robot::homes.size() && grid_width ); // Index() first
+
+  const int cx( GridCoord( x ) ), cy( GridCoord( y ) );
+  const int reach( grid_width > 1 ? 1 : 0 );
+
+  Home* best( NULL );
+  double closest_range( 1e12 ); // huge
+
+  for( int gy(cy-reach); gy<=cy+reach; gy++ )
+    for( int gx(cx-reach); gx<=cx+reach; gx++ )
+      FOR_EACH( h, grid[ GridWrap(gx) + GridWrap(gy) * grid_width ] )
+	{
+	  const double range( WrapRange( *h, x, y ) );
+	  // ties go to the lowest id, as they did when every home was scanned in order
+	  if( range < (*h)->r &&
+	      (range < closest_range || (range == closest_range && (*h)->id < best->id)) )
+	    {
+	      best = *h;
+	      closest_range = range;
+	    }
+	}
+
+  return best;
+}
+
+Home* Home::Nearest( double x, double y )
+{
+  assert( indexed == Robot::homes.size() && grid_width ); // Index() first
+
+  const int cx( GridCoord( x ) ), cy( GridCoord( y ) );
+
+  Home* best( NULL );
+  double closest_range( 1e12 ); // huge
+
+  // search square rings of cells outwards. Homes beyond ring k are
+  // more than k cells away, so stop once the best is closer than that.
+  for( int k(0); k <= (int)grid_width/2; k++ )
+    {
+      for( int gy(cy-k); gy<=cy+k; gy++ )
+	for( int gx(cx-k); gx<=cx+k; gx++ )
+	  {
+	    // just the ring
+	    if( abs(gx-cx) != k && abs(gy-cy) != k )
+	      continue;
+
+	    FOR_EACH( h, grid[ GridWrap(gx) + GridWrap(gy) * grid_width ] )
+	      {
+		const double range( WrapRange( *h, x, y ) );
+		if( range < closest_range || (range == closest_range && (*h)->id < best->id) )
+		  {
+		    best = *h;
+		    closest_range = range;
+		  }
+	      }
+	  }
+
+      if( best && closest_range <= k * cell_size )
+	break;
+    }
+
+  return best;
+}
@@ -17,22 +17,37 @@ int main( int argc, char* argv[] )
 {
   // configure global robot settings
   Robot::Init( argc, argv );
+
+  // a replay makes its world from the recording
+  if( Replay::filename )
+    {
+      Replay::Start();
+      Robot::Run();
+    }
   
   // create each home, and each robot within each home
   for( unsigned int i=0; i<Robot::home_count; i++ )
     {
       Home* h( new Home( i,
-			 i < color_count ? colors[i] : Home::Color::Random(), 
-			 i ? drand48() * Robot::worldsize : Robot::worldsize/2.0,
-			 i ? drand48() * Robot::worldsize : Robot::worldsize/2.0,													
+			 i < color_count ? colors[i] : Home::Color::Random(i), 
+			 i ? Rng::Uniform( Rng::STREAM_HOME, i, Rng::SETUP, 3 ) * Robot::worldsize : Robot::worldsize/2.0,
+			 i ? Rng::Uniform( Rng::STREAM_HOME, i, Rng::SETUP, 4 ) * Robot::worldsize : Robot::worldsize/2.0,													
 			 0.1 ));
       
       for( unsigned int i(0); i<Robot::home_population; i++ )
 	new Forager( h );
+
+      // control them all at once if asked to
+      if( Robot::teams )
+	new ForagerTeam( h );
     }		
+
+  // the pucks find the homes they start in with it
+  Home::Index();
   
   for( unsigned int i=0; i<Robot::puck_count; i++ )
-    new Puck( drand48() * Robot::worldsize, drand48() * Robot::worldsize );
+    new Puck( Rng::Uniform( Rng::STREAM_PUCK, i, Rng::SETUP, 0 ) * Robot::worldsize,
+	      Rng::Uniform( Rng::STREAM_PUCK, i, Rng::SETUP, 1 ) * Robot::worldsize );
 
   // and start the simulation running
   Robot::Run();
@@ -0,0 +1,191 @@
+/****
+     metrics.cc
+     version 1
+     Low-overhead counters of where each update spends its time
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <algorithm>
+#include <string.h>
+#include <time.h>
+#include "antix.h"
+using namespace Antix;
+
+#if METRICS
+
+std::vector<Metrics::worker_t> Metrics::workers;
+uint64_t Metrics::histogram[PHASE_COUNT][Metrics::BUCKETS];
+double Metrics::phase_max[PHASE_COUNT];
+double Metrics::phase_total[PHASE_COUNT];
+double Metrics::pool_seconds(0);
+unsigned int Metrics::interval(10);
+FILE* Metrics::out(stdout);
+
+// the end of the last report
+static double last_seconds(0);
+static uint64_t last_updates(0);
+static double start_seconds(0);
+
+void Metrics::Init( unsigned int threads, const char* filename )
+{
+  workers.resize( threads );
+
+  if( filename )
+    {
+      out = fopen( filename, "w" );
+      if( out == NULL )
+	{
+	  perror( "[Antix] metrics file" );
+	  exit(-1); // error
+	}
+    }
+
+  start_seconds = last_seconds = Now();
+}
+
+double Metrics::Now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return( ts.tv_sec + ts.tv_nsec/1e9 );
+}
+
+void Metrics::Phase( phase_t phase, double seconds )
+{
+  unsigned int b(0);
+  for( uint64_t usec( seconds * 1e6 ); usec && b < BUCKETS-1; usec >>= 1 )
+    b++;
+
+  histogram[phase][b]++;
+  phase_total[phase] += seconds;
+  if( seconds > phase_max[phase] )
+    phase_max[phase] = seconds;
+}
+
+// the upper limit of the histogram bucket below which a fraction of
+// the samples fall, in milliseconds, or the longest sample if that is
+// less
+static double Percentile( const uint64_t* hist, uint64_t count, double fraction, double max )
+{
+  uint64_t sum(0);
+  unsigned int b(0);
+  for( ; b<Metrics::BUCKETS-1; b++ )
+    {
+      sum += hist[b];
+      if( sum >= fraction * count )
+	break;
+    }
+  return( std::min( (1u << b) / 1e3, 1e3 * max ) );
+}
+
+// the mean, largest and coefficient of variation of a set of counts,
+// and the fraction that are zero
+// counts lists the robots or pucks in some of the cells, and the rest
+// are empty
+static void PrintOccupancy( const char* label, const std::vector<unsigned int>& counts, double cells )
+{
+  double sum(0), sumsq(0);
+  unsigned int max(0), occupied(0);
+  FOR_EACH( it, counts )
+    {
+      sum += *it;
+      sumsq += (double)*it * *it;
+      max = std::max( max, *it );
+      if( *it )
+	occupied++;
+    }
+
+  const double mean( sum / cells );
+  const double var( sumsq / cells - mean * mean );
+  fprintf( Metrics::out, " %s mean %.2f max %u cv %.2f empty %.1f%%",
+	   label, mean, max, mean > 0 ? sqrt( std::max( 0.0, var ) ) / mean : 0.0,
+	   100.0 * (cells - occupied) / cells );
+}
+
+void Metrics::Report()
+{
+  const double now( Now() );
+  const uint64_t updates( Robot::updates - last_updates );
+  if( updates == 0 )
+    return;
+
+  fprintf( out, "[Antix] metrics %llu: %.2f updates/sec (%.2f average)\n",
+	   (long long unsigned)Robot::updates,
+	   updates / (now - last_seconds),
+	   Robot::updates / (now - start_seconds) );
+
+  for( int p(0); p<PHASE_COUNT; p++ )
+    fprintf( out, "[Antix] metrics %-7s mean %8.3f p50 %8.3f p90 %8.3f p99 %8.3f max %8.3f msec\n",
+	     phase_names[p],
+	     1e3 * phase_total[p] / updates,
+	     Percentile( histogram[p], updates, 0.5, phase_max[p] ),
+	     Percentile( histogram[p], updates, 0.9, phase_max[p] ),
+	     Percentile( histogram[p], updates, 0.99, phase_max[p] ),
+	     1e3 * phase_max[p] );
+
+  // combine the workers' counters
+  worker_t total;
+  memset( &total, 0, sizeof(total) );
+  FOR_EACH( w, workers )
+    {
+      total.migrations += w->migrations;
+      total.sensed += w->sensed;
+      total.see_robots += w->see_robots;
+      total.see_pucks += w->see_pucks;
+      total.see_robots_max = std::max( total.see_robots_max, w->see_robots_max );
+      total.see_pucks_max = std::max( total.see_pucks_max, w->see_pucks_max );
+      total.busy_seconds += w->busy_seconds;
+    }
+
+  const unsigned int robots( Robot::world.RobotCount() );
+  fprintf( out, "[Antix] metrics migrations %.1f per update (%.2f%% of robots)\n",
+	   (double)total.migrations / updates,
+	   robots ? 100.0 * total.migrations / ((double)updates * robots) : 0.0 );
+
+  if( total.sensed )
+    fprintf( out, "[Antix] metrics sensed robots mean %.2f max %u pucks mean %.2f max %u\n",
+	     (double)total.see_robots / total.sensed, total.see_robots_max,
+	     (double)total.see_pucks / total.sensed, total.see_pucks_max );
+
+  // how evenly the robots and pucks are spread over the matrix now
+  const unsigned int cells( Robot::matrixwidth * Robot::matrixwidth );
+  std::vector<unsigned int> robot_counts, puck_counts;
+  if( Robot::matrix_type == Robot::MATRIX_SPARSE )
+    FOR_EACH( table, Robot::sparse.partitions )
+      FOR_EACH( it, *table )
+	{
+	  robot_counts.push_back( it->second.robots.size() );
+	  puck_counts.push_back( it->second.pucks.size() );
+	}
+  else
+    for( unsigned int c(0); c<cells; c++ )
+      {
+	const unsigned int *begin, *end;
+	Robot::CellRobots( c, begin, end );
+	robot_counts.push_back( end - begin );
+	Robot::CellPucks( c, begin, end );
+	puck_counts.push_back( end - begin );
+      }
+  fprintf( out, "[Antix] metrics cells" );
+  PrintOccupancy( "robots", robot_counts, cells );
+  PrintOccupancy( "pucks", puck_counts, cells );
+  fprintf( out, "\n" );
+
+  if( pool_seconds > 0 )
+    fprintf( out, "[Antix] metrics pool idle %.1f%% of %.3f msec per update in parallel loops\n",
+	     100.0 * std::max( 0.0, pool_seconds - total.busy_seconds ) / pool_seconds,
+	     1e3 * pool_seconds / (Pool::active * updates) );
+
+  fflush( out );
+
+  // start again
+  memset( histogram, 0, sizeof(histogram) );
+  memset( phase_max, 0, sizeof(phase_max) );
+  memset( phase_total, 0, sizeof(phase_total) );
+  memset( &workers[0], 0, workers.size() * sizeof(worker_t) );
+  pool_seconds = 0;
+  last_seconds = now;
+  last_updates = Robot::updates;
+}
+
+#endif // METRICS
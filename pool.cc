@@ -0,0 +1,142 @@
+/****
+     pool.cc
+     version 1
+     Persistent worker threads that share out chunked parallel loops
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <algorithm>
+#include "antix.h"
+using namespace Antix;
+
+unsigned int Pool::threads(1);
+unsigned int Pool::active(1);
+
+static pthread_mutex_t pool_mutex;
+static pthread_cond_t cond_start;
+static pthread_cond_t cond_done;
+static uint64_t generation(0); // incremented each time a job is posted
+static uint64_t start_generation(0); // the generation when the workers were started
+static unsigned int busy(0); // number of workers still running the current job
+
+// the current job
+static Pool::func_t job_func(NULL);
+static unsigned int job_count(0);
+static unsigned int job_chunk(1);
+static unsigned int job_next(0); // first item not yet claimed by a worker
+
+// claim chunks of the current job until there are none left
+static void RunChunks( unsigned int worker )
+{
+#if METRICS
+  const double start( Metrics::Now() );
+#endif
+
+  while( true )
+    {
+      const unsigned int first( __sync_fetch_and_add( &job_next, job_chunk ) );
+      if( first >= job_count )
+	break;
+
+      (*job_func)( first, std::min( first + job_chunk, job_count ), worker );
+    }
+
+#if METRICS
+  Metrics::workers[worker].busy_seconds += Metrics::Now() - start;
+#endif
+}
+
+static void* WorkerThreadEntry( void* arg )
+{
+  const unsigned int worker( (uintptr_t)arg );
+  uint64_t seen(start_generation);
+
+  pthread_mutex_lock( &pool_mutex );
+
+  while( true )
+    {
+      // wait for the main thread to post a new job
+      while( generation == seen )
+	pthread_cond_wait( &cond_start, &pool_mutex );
+
+      seen = generation;
+      const bool taking_part( worker < Pool::active );
+      pthread_mutex_unlock( &pool_mutex );
+
+      if( taking_part )
+	RunChunks( worker );
+
+      pthread_mutex_lock( &pool_mutex );
+
+      // if we're the last worker done, signal the main thread
+      if( taking_part && --busy == 0 )
+	pthread_cond_signal( &cond_done );
+      // keep lock going round the loop
+    }
+
+  return NULL; // compiler satisfaction
+}
+
+void Pool::Init( unsigned int count )
+{
+  threads = active = std::max( 1u, count );
+  start_generation = generation; // not 0 if started again after fork()
+
+  pthread_mutex_init( &pool_mutex, NULL );
+  pthread_cond_init( &cond_start, NULL );
+  pthread_cond_init( &cond_done, NULL );
+
+  // the calling thread is worker 0, so start one fewer. They do
+  // nothing until a job is posted by ParallelFor()
+  for( unsigned int w(1); w<threads; w++ )
+    {
+      pthread_t pt;
+      pthread_create( &pt, NULL, WorkerThreadEntry, (void*)(uintptr_t)w );
+    }
+}
+
+void Pool::ParallelFor( unsigned int count, func_t func, unsigned int chunk )
+{
+  if( chunk == 0 ) // a few chunks per thread helps balance the load
+    chunk = std::max( 1u, count / (active * 8) );
+
+#if METRICS
+  // the other workers are idle for as long as this takes
+  const double start( Metrics::Now() );
+#endif
+
+  // not worth waking anyone up
+  if( active < 2 || count <= chunk )
+    {
+      (*func)( 0, count, 0 );
+#if METRICS
+      const double seconds( Metrics::Now() - start );
+      Metrics::workers[0].busy_seconds += seconds;
+      Metrics::pool_seconds += active * seconds;
+#endif
+      return;
+    }
+
+  pthread_mutex_lock( &pool_mutex );
+  job_func = func;
+  job_count = count;
+  job_chunk = chunk;
+  job_next = 0;
+  busy = active - 1;
+  ++generation;
+  pthread_cond_broadcast( &cond_start );
+  pthread_mutex_unlock( &pool_mutex );
+
+  // do our share
+  RunChunks( 0 );
+
+  // wait for the others to finish their last chunks
+  pthread_mutex_lock( &pool_mutex );
+  while( busy )
+    pthread_cond_wait( &cond_done, &pool_mutex );
+  pthread_mutex_unlock( &pool_mutex );
+
+#if METRICS
+  Metrics::pool_seconds += active * (Metrics::Now() - start);
+#endif
+}
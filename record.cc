@@ -0,0 +1,323 @@
+/****
+     record.cc
+     version 1
+     Streams quantized, delta-encoded frames of the world to a file
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <string.h>
+#include "antix.h"
+#include "record.h"
+using namespace Antix;
+using namespace Antix::Record;
+
+const char* Recorder::filename(NULL);
+unsigned int Recorder::interval(1);
+unsigned int Recorder::keyframe_interval(64);
+
+// the quantized state of the world at one update
+class snapshot_t
+{
+public:
+  uint64_t update;
+  std::vector<uint16_t> robot_x, robot_y, robot_a;
+  std::vector<uint8_t> robot_held;
+  std::vector<uint16_t> puck_x, puck_y;
+  std::vector<uint8_t> puck_held;
+  std::vector<uint32_t> score;
+
+  void Resize( unsigned int robots, unsigned int pucks, unsigned int homes )
+  {
+    robot_x.resize( robots );
+    robot_y.resize( robots );
+    robot_a.resize( robots );
+    robot_held.resize( robots );
+    puck_x.resize( pucks );
+    puck_y.resize( pucks );
+    puck_held.resize( pucks );
+    score.resize( homes );
+  }
+};
+
+static FILE* file(NULL);
+static pthread_t writer_thread;
+
+// The simulator fills one buffer while the writer encodes the other.
+// queued[i] is set when buffer i is ready to write, and cleared by the
+// writer when it is done with it.
+static snapshot_t buffers[2];
+static bool queued[2] = { false, false };
+static unsigned int next_fill(0); // the buffer the simulator fills next
+static bool stopping(false);
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cond_free = PTHREAD_COND_INITIALIZER;
+
+// owned by the writer thread
+static snapshot_t previous; // the last frame written, the base of the deltas
+static uint64_t frames(0);
+static uint64_t offset(0); // bytes written so far
+static bool failed(false); // stop writing after an error
+static std::vector<index_entry_t> keyframes;
+static std::vector<uint8_t> payload;
+
+// quantize a chunk of the robots into the buffer being filled. Robots
+// are recorded in order of id, which stays the same if they are
+// reordered.
+static void CaptureRobotsChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  const World& world( Robot::world );
+  snapshot_t& snap( buffers[next_fill] );
+  for( unsigned int i(first); i<last; i++ )
+    {
+      const unsigned int r( world.id[i] );
+      snap.robot_x[r] = QuantizePosition( world.x[i], Robot::worldsize );
+      snap.robot_y[r] = QuantizePosition( world.y[i], Robot::worldsize );
+      snap.robot_a[r] = QuantizeAngle( world.a[i] );
+      snap.robot_held[r] = world.held_puck[i] >= 0;
+    }
+}
+
+static void CapturePucksChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  const World& world( Robot::world );
+  snapshot_t& snap( buffers[next_fill] );
+  for( unsigned int i(first); i<last; i++ )
+    {
+      const Puck* p( world.pucks[i] );
+      snap.puck_x[i] = QuantizePosition( p->x, Robot::worldsize );
+      snap.puck_y[i] = QuantizePosition( p->y, Robot::worldsize );
+      snap.puck_held[i] = p->held;
+    }
+}
+
+static void PutDelta( const std::vector<uint16_t>& now, const std::vector<uint16_t>& before, unsigned int i )
+{
+  PutVarint( payload, ZigZag( (int16_t)(uint16_t)(now[i] - before[i]) ) );
+}
+
+static void PutChanges( const std::vector<uint8_t>& now, const std::vector<uint8_t>& before )
+{
+  unsigned int changes(0);
+  for( unsigned int i(0); i<now.size(); i++ )
+    changes += now[i] != before[i];
+
+  PutVarint( payload, changes );
+  unsigned int last(0);
+  for( unsigned int i(0); i<now.size(); i++ )
+    if( now[i] != before[i] )
+      {
+	PutVarint( payload, i - last );
+	last = i;
+      }
+}
+
+static bool WriteBytes( const void* data, size_t bytes )
+{
+  offset += bytes;
+  return( fwrite( data, 1, bytes, file ) == bytes );
+}
+
+// encode a frame against the one before and append it to the file
+static void WriteFrame( const snapshot_t& snap )
+{
+  const bool keyframe( frames % Recorder::keyframe_interval == 0 );
+  if( keyframe )
+    {
+      // deltas from zero
+      const unsigned int robots( snap.robot_x.size() );
+      const unsigned int pucks( snap.puck_x.size() );
+      const unsigned int homes( snap.score.size() );
+      previous = snapshot_t();
+      previous.Resize( robots, pucks, homes );
+
+      index_entry_t entry = { snap.update, offset };
+      keyframes.push_back( entry );
+    }
+
+  payload.clear();
+  for( unsigned int i(0); i<snap.robot_x.size(); i++ )
+    {
+      PutDelta( snap.robot_x, previous.robot_x, i );
+      PutDelta( snap.robot_y, previous.robot_y, i );
+      PutDelta( snap.robot_a, previous.robot_a, i );
+    }
+  PutChanges( snap.robot_held, previous.robot_held );
+
+  for( unsigned int i(0); i<snap.puck_x.size(); i++ )
+    {
+      PutDelta( snap.puck_x, previous.puck_x, i );
+      PutDelta( snap.puck_y, previous.puck_y, i );
+    }
+  PutChanges( snap.puck_held, previous.puck_held );
+
+  for( unsigned int h(0); h<snap.score.size(); h++ )
+    PutVarint( payload, ZigZag( (int64_t)snap.score[h] - (int64_t)previous.score[h] ) );
+
+  frame_header_t hdr;
+  memset( &hdr, 0, sizeof(hdr) );
+  hdr.update = snap.update;
+  hdr.flags = keyframe ? KEYFRAME : 0;
+  hdr.bytes = payload.size();
+
+  if( ! WriteBytes( &hdr, sizeof(hdr) ) || ! WriteBytes( payload.data(), payload.size() ) )
+    {
+      // carry on simulating, which may be worth more than the recording
+      perror( "[Antix] recording stopped" );
+      failed = true;
+    }
+
+  previous = snap;
+  frames++;
+}
+
+static void* WriterThreadEntry( void* arg )
+{
+  unsigned int next(0);
+
+  pthread_mutex_lock( &mutex );
+  while( true )
+    {
+      while( ! queued[next] && ! stopping )
+	pthread_cond_wait( &cond_queued, &mutex );
+
+      if( ! queued[next] )
+	break; // stopping, and everything is written
+
+      pthread_mutex_unlock( &mutex );
+      if( ! failed )
+	WriteFrame( buffers[next] );
+      pthread_mutex_lock( &mutex );
+
+      queued[next] = false;
+      pthread_cond_signal( &cond_free );
+      next ^= 1;
+    }
+  pthread_mutex_unlock( &mutex );
+
+  return NULL;
+}
+
+// copy the world into the next buffer and hand it to the writer
+static void Snapshot()
+{
+  pthread_mutex_lock( &mutex );
+  while( queued[next_fill] )
+    pthread_cond_wait( &cond_free, &mutex ); // the writer is behind
+  pthread_mutex_unlock( &mutex );
+
+  snapshot_t& snap( buffers[next_fill] );
+  snap.update = Robot::updates;
+  Pool::ParallelFor( Robot::world.RobotCount(), CaptureRobotsChunk );
+  Pool::ParallelFor( Robot::world.pucks.size(), CapturePucksChunk );
+  for( unsigned int h(0); h<Robot::homes.size(); h++ )
+    snap.score[h] = Robot::homes[h]->score;
+
+  pthread_mutex_lock( &mutex );
+  queued[next_fill] = true;
+  pthread_cond_signal( &cond_queued );
+  pthread_mutex_unlock( &mutex );
+
+  next_fill ^= 1;
+}
+
+void Recorder::Start()
+{
+  file = fopen( filename, "wb" );
+  if( file == NULL )
+    {
+      perror( "[Antix] recording" );
+      exit(-1); // error
+    }
+
+  const World& world( Robot::world );
+  const unsigned int robots( world.RobotCount() );
+  const unsigned int pucks( world.pucks.size() );
+  const unsigned int homes( Robot::homes.size() );
+
+  file_header_t hdr;
+  memset( &hdr, 0, sizeof(hdr) );
+  memcpy( hdr.magic, MAGIC, sizeof(MAGIC) );
+  hdr.version = VERSION;
+  hdr.header_bytes = sizeof(hdr);
+  hdr.robots = robots;
+  hdr.pucks = pucks;
+  hdr.homes = homes;
+  hdr.interval = interval;
+  hdr.keyframe_interval = keyframe_interval;
+  hdr.worldsize = Robot::worldsize;
+
+  std::vector<home_record_t> home_records( homes );
+  for( unsigned int h(0); h<homes; h++ )
+    {
+      const Home* home( Robot::homes[h] );
+      home_record_t& rec( home_records[h] );
+      rec.x = home->x;
+      rec.y = home->y;
+      rec.r = home->r;
+      rec.red = home->color.r;
+      rec.green = home->color.g;
+      rec.blue = home->color.b;
+    }
+
+  std::vector<uint32_t> home_ids( robots );
+  for( unsigned int s(0); s<robots; s++ )
+    home_ids[ world.id[s] ] = world.home_id[s];
+
+  if( ! WriteBytes( &hdr, sizeof(hdr) ) ||
+      ! WriteBytes( home_records.data(), homes * sizeof(home_record_t) ) ||
+      ! WriteBytes( home_ids.data(), robots * sizeof(uint32_t) ) )
+    {
+      perror( "[Antix] recording" );
+      exit(-1); // error
+    }
+
+  buffers[0].Resize( robots, pucks, homes );
+  buffers[1].Resize( robots, pucks, homes );
+
+  if( pthread_create( &writer_thread, NULL, WriterThreadEntry, NULL ) != 0 )
+    {
+      perror( "[Antix] recording thread" );
+      exit(-1); // error
+    }
+
+  atexit( Stop );
+  printf( "[Antix] recording every %u updates to %s\n", interval, filename );
+
+  // the state we start from
+  Snapshot();
+}
+
+void Recorder::Capture()
+{
+  if( file && Robot::updates % interval == 0 )
+    Snapshot();
+}
+
+void Recorder::Stop()
+{
+  if( file == NULL )
+    return;
+
+  pthread_mutex_lock( &mutex );
+  stopping = true;
+  pthread_cond_signal( &cond_queued );
+  pthread_mutex_unlock( &mutex );
+  pthread_join( writer_thread, NULL );
+
+  trailer_t trailer;
+  memset( &trailer, 0, sizeof(trailer) );
+  trailer.index_offset = offset;
+  trailer.keyframes = keyframes.size();
+  memcpy( trailer.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC) );
+
+  if( failed ||
+      ! WriteBytes( keyframes.data(), keyframes.size() * sizeof(index_entry_t) ) ||
+      ! WriteBytes( &trailer, sizeof(trailer) ) ||
+      fclose( file ) != 0 )
+    perror( "[Antix] recording" );
+
+  printf( "[Antix] recorded %llu frames, %llu bytes\n",
+	  (long long unsigned)frames, (long long unsigned)offset );
+  file = NULL;
+}
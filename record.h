@@ -0,0 +1,148 @@
+/****
+     record.h
+     version 1
+     The format of the files written by Antix::Recorder
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+// A recording is a file header, the homes and the robots' homes,
+// then frames, then an index of the keyframes:
+//
+//   file_header_t
+//   home_record_t[homes]
+//   uint32_t home id [robots]
+//   { frame_header_t, payload[bytes] } ...
+//   index_entry_t[keyframes]
+//   trailer_t
+//
+// Positions are quantized to 16 bits across the world, and headings
+// to 16 bits around the circle. A frame's payload is, in order,
+//
+//   for each robot: x, y, a          as deltas
+//   robots holding a puck            as a change list
+//   for each puck: x, y              as deltas
+//   pucks being carried              as a change list
+//   for each home: score             as a delta
+//
+// A delta is the difference from the value in the frame before, or
+// from zero in a keyframe, zig-zag encoded as a varint. 16-bit
+// deltas wrap, so a robot crossing the edge of the world costs a
+// byte, not three. A change list is a varint count of the entries
+// whose flag differs from the frame before (all false before a
+// keyframe), then the gaps between their indices as varints.
+//
+// A recording cut short has no index or trailer, but its frames can
+// still be read from the start, since each gives its length.
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+namespace Antix
+{
+  namespace Record
+  {
+    static const char MAGIC[8] = { 'A','n','t','i','x','R','e','c' };
+    static const char INDEX_MAGIC[8] = { 'A','n','t','i','x','I','d','x' };
+
+    static const uint32_t KEYFRAME = 1; // frame_header_t flags
+
+    typedef struct
+    {
+      char magic[8];
+      uint32_t version;
+      uint32_t header_bytes;
+      uint32_t robots, pucks, homes;
+      uint32_t interval; // updates between frames
+      uint32_t keyframe_interval; // frames between keyframes
+      uint32_t pad;
+      double worldsize;
+    } file_header_t;
+
+    typedef struct
+    {
+      double x, y, r;
+      double red, green, blue;
+    } home_record_t;
+
+    typedef struct
+    {
+      uint64_t update;
+      uint32_t flags;
+      uint32_t bytes; // of the payload that follows
+    } frame_header_t;
+
+    typedef struct
+    {
+      uint64_t update;
+      uint64_t offset; // of the keyframe's header in the file
+    } index_entry_t;
+
+    typedef struct
+    {
+      uint64_t index_offset;
+      uint64_t keyframes;
+      char magic[8];
+    } trailer_t;
+
+    inline uint16_t QuantizePosition( double d, double worldsize )
+    {
+      const int q( (int)floor( d / worldsize * 65536.0 ) );
+      return( (uint16_t)(q & 0xffff) );
+    }
+
+    inline double Position( uint16_t q, double worldsize )
+    {
+      return( (q + 0.5) * worldsize / 65536.0 );
+    }
+
+    inline uint16_t QuantizeAngle( double a )
+    {
+      const int q( (int)floor( a / (2.0 * M_PI) * 65536.0 ) );
+      return( (uint16_t)(q & 0xffff) );
+    }
+
+    inline double Angle( uint16_t q )
+    {
+      return( (int16_t)q * (2.0 * M_PI) / 65536.0 );
+    }
+
+    inline void PutVarint( std::vector<uint8_t>& out, uint64_t v )
+    {
+      while( v >= 0x80 )
+	{
+	  out.push_back( (v & 0x7f) | 0x80 );
+	  v >>= 7;
+	}
+      out.push_back( v );
+    }
+
+    inline uint64_t GetVarint( const uint8_t*& in )
+    {
+      uint64_t v(0);
+      for( unsigned int shift(0); ; shift += 7 )
+	{
+	  const uint8_t b( *in++ );
+	  v |= (uint64_t)(b & 0x7f) << shift;
+	  if( (b & 0x80) == 0 )
+	    return v;
+	}
+    }
+
+    // small differences either way become small unsigned numbers
+    inline uint64_t ZigZag( int64_t d )
+    {
+      return( ((uint64_t)d << 1) ^ (uint64_t)(d >> 63) );
+    }
+
+    inline int64_t UnZigZag( uint64_t v )
+    {
+      return( (int64_t)(v >> 1) ^ -(int64_t)(v & 1) );
+    }
+  }
+}
+
+#endif
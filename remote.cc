@@ -0,0 +1,479 @@
+/****
+     remote.cc
+     version 1
+     Robot controllers running in separate processes, exchanging
+     sensor results and commands through shared memory
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "antix.h"
+using namespace Antix;
+
+unsigned int Remote::processes(0);
+bool Remote::child(false);
+
+// Each home has a region of shared memory laid out as
+//   header | commands[robots] | robots[robots] | see_robots[] | see_pucks[]
+// The simulator fills in everything but the commands, then sets seq
+// to the update number. The controller process waits for seq to
+// change, runs its robots' controllers, writes their commands and
+// sets ack to seq. The sensor results vary in size, so the simulator
+// grows the region when needed and the controller process follows.
+
+typedef struct
+{
+  volatile uint64_t seq; // update published by the simulator
+  char pad0[56];
+  volatile uint64_t ack; // update whose commands are ready
+  char pad1[56];
+  volatile uint64_t size; // bytes in the region
+  unsigned int robots;
+  unsigned int see_robots, see_pucks; // sensor records in use
+} header_t;
+
+// what a robot wants done with pucks
+enum { INTENT_DROP=1, INTENT_PICKUP=2 };
+
+typedef struct
+{
+  double v, w;
+  int intent;
+  unsigned int puck; // to pick up, if intent has INTENT_PICKUP
+} command_t;
+
+typedef struct
+{
+  double x, y, a;
+  int held_puck;
+  unsigned int see_robots, see_pucks; // this robot's sensor records
+} robot_record_t;
+
+typedef struct
+{
+  unsigned int slot;
+  int haspuck;
+  double x, y, a; // the robot's pose, for the controller process's world
+  double range, bearing;
+} see_robot_t;
+
+typedef struct
+{
+  unsigned int puck;
+  int held;
+  double range, bearing;
+} see_puck_t;
+
+typedef struct
+{
+  int fd;
+  char* base;
+  size_t mapped; // bytes of the region mapped by this process
+  std::vector<unsigned int> slots; // the home's robots, in slot order
+} region_t;
+
+static std::vector<region_t> regions; // indexed by home
+static std::vector<unsigned int> region_index; // each slot's position in its home's region
+static std::vector<pid_t> pids;
+static pid_t parent(0);
+
+// the command of the robot whose controller is running
+static command_t* current(NULL);
+
+static inline header_t* Header( region_t& r )
+{
+  return( (header_t*)r.base );
+}
+
+static inline command_t* Commands( region_t& r )
+{
+  return( (command_t*)(r.base + sizeof(header_t)) );
+}
+
+static inline robot_record_t* Records( region_t& r )
+{
+  return( (robot_record_t*)(Commands( r ) + r.slots.size()) );
+}
+
+static inline see_robot_t* SeeRobots( region_t& r )
+{
+  return( (see_robot_t*)(Records( r ) + r.slots.size()) );
+}
+
+static inline see_puck_t* SeePucks( region_t& r )
+{
+  return( (see_puck_t*)(SeeRobots( r ) + Header( r )->see_robots) );
+}
+
+static size_t RegionSize( unsigned int robots, unsigned int see_robots, unsigned int see_pucks )
+{
+  return( sizeof(header_t) +
+	  robots * (sizeof(command_t) + sizeof(robot_record_t)) +
+	  see_robots * sizeof(see_robot_t) +
+	  see_pucks * sizeof(see_puck_t) );
+}
+
+// map the region at its current size
+static void Map( region_t& r, size_t size )
+{
+  if( r.base )
+    munmap( r.base, r.mapped );
+
+  r.base = (char*)mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, r.fd, 0 );
+  if( r.base == MAP_FAILED )
+    {
+      perror( "[Antix] mmap" );
+      exit(-1);
+    }
+  r.mapped = size;
+}
+
+// make the region at least this big. Only the simulator does this.
+static void Grow( region_t& r, size_t size )
+{
+  if( ftruncate( r.fd, size ) != 0 )
+    {
+      perror( "[Antix] ftruncate" );
+      exit(-1);
+    }
+  Map( r, size );
+  Header( r )->size = size;
+}
+
+// wait for a counter in shared memory to reach a value. Spin briefly,
+// then yield, then sleep in growing steps, so waiting processes don't
+// take the CPU from the ones with work to do
+static void WaitFor( volatile uint64_t* counter, uint64_t value )
+{
+  for( unsigned int tries(0); *counter != value; tries++ )
+    {
+      if( tries < 100 )
+	continue;
+
+      if( tries < 200 )
+	sched_yield();
+      else
+	{
+	  usleep( std::min( 1000u, tries - 200 ) );
+
+	  // a controller process quits if the simulator has gone, and
+	  // the simulator quits if a controller process has
+	  if( Remote::child && getppid() != parent )
+	    _exit(0);
+	  if( ! Remote::child && waitpid( -1, NULL, WNOHANG ) > 0 )
+	    {
+	      fprintf( stderr, "[Antix] a controller process has died\n" );
+	      exit(-1);
+	    }
+	}
+    }
+
+  __sync_synchronize(); // see everything written before the counter
+}
+
+// fill in a home's region from the world
+static void PublishChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  World& world( Robot::world );
+
+  for( unsigned int h(first); h<last; h++ )
+    {
+      region_t& r( regions[h] );
+
+      unsigned int see_robots(0), see_pucks(0);
+      FOR_EACH( s, r.slots )
+	{
+	  see_robots += world.handle[*s]->see_robots.size();
+	  see_pucks += world.handle[*s]->see_pucks.size();
+	}
+
+      const size_t size( RegionSize( r.slots.size(), see_robots, see_pucks ) );
+      if( size > r.mapped )
+	Grow( r, 2 * size );
+
+      header_t* hdr( Header( r ) );
+      hdr->see_robots = see_robots;
+      hdr->see_pucks = see_pucks;
+
+      robot_record_t* rec( Records( r ) );
+      see_robot_t* sr( SeeRobots( r ) );
+      see_puck_t* sp( SeePucks( r ) );
+
+      FOR_EACH( s, r.slots )
+	{
+	  const Robot* robot( world.handle[*s] );
+
+	  rec->x = world.x[*s];
+	  rec->y = world.y[*s];
+	  rec->a = world.a[*s];
+	  rec->held_puck = world.held_puck[*s];
+	  rec->see_robots = robot->see_robots.size();
+	  rec->see_pucks = robot->see_pucks.size();
+	  rec++;
+
+	  FOR_EACH( it, robot->see_robots )
+	    {
+	      sr->slot = it->slot;
+	      sr->haspuck = it->HasPuck();
+	      sr->x = world.x[it->slot];
+	      sr->y = world.y[it->slot];
+	      sr->a = world.a[it->slot];
+	      sr->range = it->range;
+	      sr->bearing = it->bearing;
+	      sr++;
+	    }
+
+	  FOR_EACH( it, robot->see_pucks )
+	    {
+	      sp->puck = it->id;
+	      sp->held = it->Held();
+	      sp->range = it->range;
+	      sp->bearing = it->bearing;
+	      sp++;
+	    }
+	}
+
+      __sync_synchronize(); // everything above before the counter
+      hdr->seq = Robot::updates + 1;
+    }
+}
+
+// copy a home's sensor results from its region into its robots
+static void Unpack( region_t& r )
+{
+  World& world( Robot::world );
+
+  header_t* hdr( Header( r ) );
+  if( hdr->size > r.mapped )
+    Map( r, hdr->size );
+  hdr = Header( r );
+
+  const robot_record_t* rec( Records( r ) );
+  const see_robot_t* sr( SeeRobots( r ) );
+  const see_puck_t* sp( SeePucks( r ) );
+
+  // the process is single threaded, so everything goes in the first
+  // worker's sensor records
+  Robot::Sensed& out( Robot::sensed[0] );
+
+  FOR_EACH( s, r.slots )
+    {
+      Robot* robot( world.handle[*s] );
+      robot->pose = Robot::Pose( rec->x, rec->y, rec->a );
+      world.x[*s] = rec->x;
+      world.y[*s] = rec->y;
+      world.a[*s] = rec->a;
+      world.held_puck[*s] = rec->held_puck;
+
+      // the robots seen are looked up in our world, so bring their
+      // poses up to date there
+      const unsigned int first_robot( out.robots.size() );
+      for( unsigned int i(0); i<rec->see_robots; i++, sr++ )
+	{
+	  world.x[sr->slot] = sr->x;
+	  world.y[sr->slot] = sr->y;
+	  world.a[sr->slot] = sr->a;
+	  out.robots.push_back( Robot::SeeRobot( sr->slot,
+						 sr->range,
+						 sr->bearing,
+						 sr->haspuck ) );
+	}
+      robot->see_robots = SenseView<Robot::SeeRobot>( out.robots, first_robot, out.robots.size() );
+
+      // our copies of the pucks are only as up to date as the
+      // sensors, which is what Robot::Pickup() looks at
+      const unsigned int first_puck( out.pucks.size() );
+      for( unsigned int i(0); i<rec->see_pucks; i++, sp++ )
+	{
+	  world.pucks[sp->puck]->held = sp->held;
+	  out.pucks.push_back( Robot::SeePuck( sp->puck, sp->range, sp->bearing, sp->held ) );
+	}
+      robot->see_pucks = SenseView<Robot::SeePuck>( out.pucks, first_puck, out.pucks.size() );
+
+      rec++;
+    }
+}
+
+// run the controllers of a home's robots and write their commands
+static void Control( region_t& r, Team* team )
+{
+  World& world( Robot::world );
+  command_t* cmd( Commands( r ) );
+
+  if( team )
+    {
+      team->Gather();
+      team->Control();
+    }
+
+  for( unsigned int i(0); i<r.slots.size(); i++, cmd++ )
+    {
+      const unsigned int s( r.slots[i] );
+
+      current = cmd;
+      cmd->intent = 0;
+      if( team )
+	team->Apply( i );
+      else
+	{
+	  Robot* robot( world.handle[s] );
+	  robot->Controller();
+	  world.v[s] = robot->speed.v;
+	  world.w[s] = robot->speed.w;
+	}
+      cmd->v = world.v[s];
+      cmd->w = world.w[s];
+    }
+
+  current = NULL;
+}
+
+// the main loop of a controller process serving homes [first,last)
+static void ControllerProcess( unsigned int first, unsigned int last )
+{
+  for( uint64_t seq(1); ; seq++ )
+    {
+      // unpack every home before running any controllers
+      Robot::sensed[0].robots.clear();
+      Robot::sensed[0].pucks.clear();
+      for( unsigned int h(first); h<last; h++ )
+	{
+	  WaitFor( &Header( regions[h] )->seq, seq );
+	  Unpack( regions[h] );
+	}
+
+      Robot::updates = seq - 1;
+
+      for( unsigned int h(first); h<last; h++ )
+	{
+	  Control( regions[h], Robot::homes[h]->team );
+	  __sync_synchronize(); // commands before the counter
+	  Header( regions[h] )->ack = seq;
+	}
+    }
+}
+
+// kill the controller processes when the simulator quits
+static void Stop()
+{
+  FOR_EACH( pid, pids )
+    kill( *pid, SIGTERM );
+  FOR_EACH( pid, pids )
+    waitpid( *pid, NULL, 0 );
+  pids.clear();
+}
+
+void Remote::Start()
+{
+  World& world( Robot::world );
+  const unsigned int homes( Robot::homes.size() );
+  processes = std::min( processes, homes );
+
+  // share out the robots by home
+  regions.resize( homes );
+  region_index.resize( world.RobotCount() );
+  for( unsigned int s(0); s<world.RobotCount(); s++ )
+    {
+      region_t& r( regions[ world.home_id[s] ] );
+      region_index[s] = r.slots.size();
+      r.slots.push_back( s );
+    }
+
+  parent = getpid();
+
+  for( unsigned int h(0); h<homes; h++ )
+    {
+      region_t& r( regions[h] );
+
+      // the name is removed at once, leaving just the descriptor
+      // for the controller processes to inherit
+      char name[64];
+      snprintf( name, sizeof(name), "/antix.%d.%u", (int)parent, h );
+      r.fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL, 0600 );
+      if( r.fd < 0 )
+	{
+	  perror( "[Antix] shm_open" );
+	  exit(-1);
+	}
+      shm_unlink( name );
+
+      r.base = NULL;
+      Grow( r, RegionSize( r.slots.size(), 0, 0 ) );
+      Header( r )->robots = r.slots.size();
+    }
+
+  // nothing buffered for output should be written twice
+  fflush( stdout );
+  fflush( stderr );
+
+  for( unsigned int p(0); p<processes; p++ )
+    {
+      const unsigned int first( (uint64_t)homes * p / processes );
+      const unsigned int last( (uint64_t)homes * (p+1) / processes );
+
+      const pid_t pid( fork() );
+      if( pid < 0 )
+	{
+	  perror( "[Antix] fork" );
+	  exit(-1);
+	}
+
+      if( pid == 0 )
+	{
+	  child = true;
+	  ControllerProcess( first, last ); // does not return
+	}
+
+      pids.push_back( pid );
+    }
+
+  atexit( Stop );
+  printf( "[Antix] started %u controller processes\n", processes );
+}
+
+void Remote::Exchange()
+{
+  World& world( Robot::world );
+
+  Pool::ParallelFor( regions.size(), PublishChunk, 1 );
+
+  FOR_EACH( r, regions )
+    WaitFor( &Header( *r )->ack, Robot::updates + 1 );
+
+  // record the pickups and drops asked for, which are settled by the
+  // same rule as when the controllers run here, so the strongest claim
+  // on each puck wins whichever process asked
+  for( unsigned int s(0); s<world.RobotCount(); s++ )
+    {
+      Robot* robot( world.handle[s] );
+      const command_t& cmd( Commands( regions[ world.home_id[s] ] )[ region_index[s] ] );
+
+      robot->speed = Robot::Speed( cmd.v, cmd.w );
+      world.v[s] = cmd.v;
+      world.w[s] = cmd.w;
+
+      if( cmd.intent )
+	robot->Request( cmd.intent & INTENT_DROP,
+			cmd.intent & INTENT_PICKUP ? world.pucks[cmd.puck] : NULL );
+    }
+
+  Robot::ResolveActions();
+}
+
+void Remote::IntendPickup( unsigned int puck )
+{
+  current->intent |= INTENT_PICKUP;
+  current->puck = puck;
+}
+
+void Remote::IntendDrop()
+{
+  current->intent |= INTENT_DROP;
+}
@@ -0,0 +1,172 @@
+/****
+     reorder.cc
+     version 1
+     Reorders the robots' storage along a Z-order curve of their
+     matrix cells
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <algorithm>
+#include "antix.h"
+using namespace Antix;
+
+unsigned int Robot::reorder_interval( 0 );
+
+// The sort key of each robot: the Z-order of its cell above its id,
+// so the robots of a cell keep to id order and no two keys tie. The
+// new order depends only on where the robots are, not on the slots
+// they were in.
+static std::vector<uint64_t> keys, merged;
+static std::vector<unsigned int> slot_of; // indexed by id
+static unsigned int merge_run; // shares in each sorted run before this merge pass
+
+// filled with the robots in their new order, then swapped with the
+// world, so the old arrays are reused next time
+static World reordered;
+
+// each thread sorts a share of the keys, and the sorted shares are
+// merged in pairs
+static inline unsigned int ShareStart( unsigned int count, unsigned int share )
+{
+  return( (uint64_t)count * std::min( share, Pool::threads ) / Pool::threads );
+}
+
+// spread the low 16 bits out to the even bits
+static inline uint64_t Spread( uint64_t v )
+{
+  v &= 0xffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+// the position of a cell along the Z-order curve, interleaving the
+// bits of its column and row
+static inline uint64_t Morton( unsigned int cell )
+{
+  return( Spread( cell % Robot::matrixwidth ) | (Spread( cell / Robot::matrixwidth ) << 1) );
+}
+
+static void KeyChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  const World& world( Robot::world );
+  for( unsigned int s(first); s<last; s++ )
+    {
+      keys[s] = (Morton( world.cell[s] ) << 32) | world.id[s];
+      slot_of[ world.id[s] ] = s;
+    }
+}
+
+static void SortChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  const unsigned int count( keys.size() );
+  for( unsigned int t(first); t<last; t++ )
+    std::sort( keys.begin() + ShareStart( count, t ), keys.begin() + ShareStart( count, t+1 ) );
+}
+
+static void MergeChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  const unsigned int count( keys.size() );
+  for( unsigned int p(first); p<last; p++ )
+    {
+      const unsigned int t( p * 2 * merge_run );
+      const unsigned int lo( ShareStart( count, t ) );
+      const unsigned int mid( ShareStart( count, t + merge_run ) );
+      const unsigned int hi( ShareStart( count, t + 2 * merge_run ) );
+      std::merge( keys.begin() + lo, keys.begin() + mid,
+		  keys.begin() + mid, keys.begin() + hi,
+		  merged.begin() + lo );
+    }
+}
+
+// copy each robot to its new slot, and point its handle and its
+// entry in its matrix cell there
+static void GatherChunk( unsigned int first, unsigned int last, unsigned int worker )
+{
+  const World& world( Robot::world );
+  const bool cells( Robot::matrix_type != Robot::MATRIX_CSR );
+  for( unsigned int n(first); n<last; n++ )
+    {
+      const unsigned int s( slot_of[ keys[n] & 0xffffffff ] );
+      reordered.x[n] = world.x[s];
+      reordered.y[n] = world.y[s];
+      reordered.a[n] = world.a[s];
+      reordered.v[n] = world.v[s];
+      reordered.w[n] = world.w[s];
+      reordered.home_id[n] = world.home_id[s];
+      reordered.held_puck[n] = world.held_puck[s];
+      reordered.claim[n] = world.claim[s];
+      reordered.dropping[n] = world.dropping[s];
+      reordered.cell[n] = world.cell[s];
+      reordered.cell_pos[n] = world.cell_pos[s];
+      reordered.sensor_bbox[n] = world.sensor_bbox[s];
+      reordered.handle[n] = world.handle[s];
+      reordered.id[n] = world.id[s];
+
+      world.handle[s]->slot = n;
+
+      // each robot has its own entry, so threads never share one. A
+      // CSR matrix is rebuilt from the new slots anyway.
+      if( cells )
+	{
+	  const unsigned int c( world.cell[s] );
+	  Robot::MatrixCell& cell( Robot::matrix_type == Robot::MATRIX_SPARSE ?
+				   Robot::sparse.At( c ) : Robot::matrix[c] );
+	  cell.robots[ world.cell_pos[s] ] = n;
+	}
+    }
+}
+
+// each team's robots keep their place in its lists, in their new slots
+static void UpdateTeams()
+{
+  FOR_EACH( h, Robot::homes )
+    {
+      Team* team( (*h)->team );
+      if( team )
+	for( unsigned int i(0); i<team->robots.size(); i++ )
+	  team->slots[i] = team->robots[i]->slot;
+    }
+}
+
+void Robot::Reorder()
+{
+  const unsigned int count( world.RobotCount() );
+  keys.resize( count );
+  merged.resize( count );
+  slot_of.resize( count );
+  reordered.Resize( count );
+
+  Pool::ParallelFor( count, KeyChunk );
+  Pool::ParallelFor( Pool::threads, SortChunk, 1 );
+  for( merge_run = 1; merge_run < Pool::threads; merge_run *= 2 )
+    {
+      const unsigned int pairs( (Pool::threads + 2 * merge_run - 1) / (2 * merge_run) );
+      Pool::ParallelFor( pairs, MergeChunk, 1 );
+      keys.swap( merged );
+    }
+
+  Pool::ParallelFor( count, GatherChunk );
+
+  // everything but the pucks has moved, so swap the arrays in whole
+  reordered.pucks.swap( world.pucks );
+  reordered.committed = world.committed;
+  std::swap( world, reordered );
+
+  UpdateTeams();
+}
+
+void Robot::AssignHandles()
+{
+  for( unsigned int s(0); s<world.RobotCount(); s++ )
+    {
+      Robot* r( population[ world.id[s] ] );
+      world.handle[s] = r;
+      world.home_id[s] = r->home->id;
+      r->slot = s;
+    }
+
+  UpdateTeams();
+}
@@ -0,0 +1,420 @@
+/****
+     replay.cc
+     version 1
+     Plays back a recording in the viewer, or headless for checks
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <algorithm>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "antix.h"
+#include "record.h"
+using namespace Antix;
+using namespace Antix::Record;
+
+const char* Replay::filename(NULL);
+const char* Replay::dump_prefix(NULL);
+unsigned int Replay::dump_size(700);
+double Replay::rate(30.0);
+
+// robots that only show where they were recorded
+class Replayed : public Robot
+{
+public:
+  Replayed( Home* home ) : Robot( home, Pose() ) {}
+  virtual void Controller() {}
+};
+
+typedef struct
+{
+  const frame_header_t* header;
+  bool keyframe;
+} frame_t;
+
+static const uint8_t* mapped(NULL);
+static const file_header_t* header(NULL);
+static const home_record_t* home_records(NULL);
+static const uint32_t* home_ids(NULL);
+static std::vector<frame_t> frames;
+
+// the decoded state of the frame shown
+static size_t current(0);
+static std::vector<uint16_t> robot_x, robot_y, robot_a, puck_x, puck_y;
+static std::vector<uint8_t> robot_held, puck_held;
+static std::vector<int64_t> score;
+
+// for headless checks
+static uint64_t checksum( 14695981039346656037ULL ); // FNV-1a of every frame shown, in order
+static uint64_t shown(0);
+
+// for playing in the viewer
+static double position(0); // in frames, fractional between them
+static double last_seconds(0);
+
+static double Now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return( ts.tv_sec + ts.tv_nsec/1e9 );
+}
+
+static void Fail( const char* message )
+{
+  fprintf( stderr, "[Antix] Can't replay %s: %s.\n", Replay::filename, message );
+  exit(-1); // error
+}
+
+void Replay::Open()
+{
+  const int fd( open( filename, O_RDONLY ) );
+  struct stat st;
+  if( fd < 0 || fstat( fd, &st ) != 0 )
+    {
+      perror( "[Antix] replay" );
+      exit(-1); // error
+    }
+
+  if( (size_t)st.st_size < sizeof(file_header_t) )
+    Fail( "too short" );
+
+  mapped = (const uint8_t*)mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  if( mapped == MAP_FAILED )
+    {
+      perror( "[Antix] replay" );
+      exit(-1); // error
+    }
+  close( fd );
+
+  header = (const file_header_t*)mapped;
+  if( memcmp( header->magic, MAGIC, sizeof(MAGIC) ) != 0 ||
+      header->version != Recorder::VERSION ||
+      header->header_bytes != sizeof(file_header_t) )
+    Fail( "not a recording of this version" );
+
+  home_records = (const home_record_t*)(mapped + sizeof(file_header_t));
+  home_ids = (const uint32_t*)(home_records + header->homes);
+  const uint8_t* p( (const uint8_t*)(home_ids + header->robots) );
+
+  // frames run up to the index, or to the end of a recording that
+  // was cut short. An index that would start outside the frames is
+  // ignored, and the frames scanned as if the recording were cut
+  // short, up to the first thing that isn't a later frame.
+  const uint8_t* end( mapped + st.st_size );
+  const trailer_t* trailer( (const trailer_t*)(end - sizeof(trailer_t)) );
+  if( (const uint8_t*)trailer > p && memcmp( trailer->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC) ) == 0 )
+    {
+      if( trailer->index_offset >= (uint64_t)(p - mapped) &&
+	  trailer->index_offset <= (uint64_t)((const uint8_t*)trailer - mapped) )
+	end = mapped + trailer->index_offset;
+      else
+	end = (const uint8_t*)trailer;
+    }
+
+  while( p + sizeof(frame_header_t) <= end )
+    {
+      const frame_header_t* hdr( (const frame_header_t*)p );
+      if( p + sizeof(frame_header_t) + hdr->bytes > end )
+	break; // cut short while writing it
+      if( ! frames.empty() && hdr->update <= frames.back().header->update )
+	break; // not a frame, so the index
+
+      const bool keyframe( hdr->flags & KEYFRAME );
+      if( frames.empty() && ! keyframe )
+	Fail( "the first frame is not a keyframe" );
+
+      frame_t f = { hdr, keyframe };
+      frames.push_back( f );
+      p += sizeof(frame_header_t) + hdr->bytes;
+    }
+
+  if( frames.empty() )
+    Fail( "no frames" );
+
+  // the world is as big as the recording's
+  Robot::worldsize = header->worldsize;
+  Robot::home_count = header->homes;
+  Robot::home_population = header->homes ? header->robots / header->homes : 0;
+  Robot::puck_count = header->pucks;
+
+  printf( "[Antix] replaying %u frames of updates %llu to %llu from %s\n",
+	  (unsigned int)frames.size(),
+	  (long long unsigned)frames.front().header->update,
+	  (long long unsigned)frames.back().header->update,
+	  filename );
+}
+
+static void Delta( std::vector<uint16_t>& values, unsigned int i, const uint8_t*& in )
+{
+  values[i] += (uint16_t)UnZigZag( GetVarint( in ) );
+}
+
+static void Changes( std::vector<uint8_t>& flags, const uint8_t*& in )
+{
+  const uint64_t changes( GetVarint( in ) );
+  uint64_t index(0);
+  for( uint64_t c(0); c<changes; c++ )
+    {
+      index += GetVarint( in );
+      if( index >= flags.size() )
+	Fail( "a frame is corrupt" );
+      flags[index] ^= 1;
+    }
+}
+
+// apply frame f to the decoded state, which must be that of the
+// frame before, unless f is a keyframe
+static void Decode( size_t f )
+{
+  const frame_header_t* hdr( frames[f].header );
+  if( frames[f].keyframe )
+    {
+      std::fill( robot_x.begin(), robot_x.end(), 0 );
+      std::fill( robot_y.begin(), robot_y.end(), 0 );
+      std::fill( robot_a.begin(), robot_a.end(), 0 );
+      std::fill( robot_held.begin(), robot_held.end(), 0 );
+      std::fill( puck_x.begin(), puck_x.end(), 0 );
+      std::fill( puck_y.begin(), puck_y.end(), 0 );
+      std::fill( puck_held.begin(), puck_held.end(), 0 );
+      std::fill( score.begin(), score.end(), 0 );
+    }
+
+  const uint8_t* in( (const uint8_t*)(hdr + 1) );
+  for( unsigned int i(0); i<header->robots; i++ )
+    {
+      Delta( robot_x, i, in );
+      Delta( robot_y, i, in );
+      Delta( robot_a, i, in );
+    }
+  Changes( robot_held, in );
+
+  for( unsigned int i(0); i<header->pucks; i++ )
+    {
+      Delta( puck_x, i, in );
+      Delta( puck_y, i, in );
+    }
+  Changes( puck_held, in );
+
+  for( unsigned int h(0); h<header->homes; h++ )
+    score[h] += UnZigZag( GetVarint( in ) );
+
+  if( in != (const uint8_t*)(hdr + 1) + hdr->bytes )
+    Fail( "a frame is corrupt" );
+
+  current = f;
+}
+
+static uint64_t Hash( uint64_t hash, const void* data, size_t bytes )
+{
+  const uint8_t* p( (const uint8_t*)data );
+  for( size_t i(0); i<bytes; i++ )
+    hash = (hash ^ p[i]) * 1099511628211ULL;
+  return hash;
+}
+
+static void SetPixel( std::vector<uint8_t>& image, double x, double y, uint8_t r, uint8_t g, uint8_t b )
+{
+  const unsigned int size( Replay::dump_size );
+  const int px( x / Robot::worldsize * size );
+  const int py( size - 1 - (int)(y / Robot::worldsize * size) ); // y up, as in the viewer
+  if( px < 0 || py < 0 || px >= (int)size || py >= (int)size )
+    return;
+  uint8_t* pixel( &image[ 3 * (py * size + px) ] );
+  pixel[0] = r;
+  pixel[1] = g;
+  pixel[2] = b;
+}
+
+// write the world as the viewer would draw it, as a binary PPM
+static void Dump()
+{
+  const unsigned int size( Replay::dump_size );
+  std::vector<uint8_t> image( 3 * size * size, 25 ); // dark grey
+
+  FOR_EACH( it, Robot::homes )
+    {
+      const Home* h( *it );
+      const unsigned int steps( 8 * size * h->r / Robot::worldsize + 16 );
+      for( unsigned int s(0); s<steps; s++ )
+	{
+	  const double a( 2.0 * M_PI * s / steps );
+	  SetPixel( image, Robot::DistanceNormalize( h->x + cos(a) * h->r ),
+		    Robot::DistanceNormalize( h->y + sin(a) * h->r ),
+		    255 * h->color.r, 255 * h->color.g, 255 * h->color.b );
+	}
+    }
+
+  const World& world( Robot::world );
+  for( unsigned int i(0); i<world.RobotCount(); i++ )
+    {
+      const Home::Color& c( Robot::homes[world.home_id[i]]->color );
+      SetPixel( image, world.x[i], world.y[i], 255 * c.r, 255 * c.g, 255 * c.b );
+    }
+
+  FOR_EACH( it, world.pucks )
+    SetPixel( image, (*it)->x, (*it)->y, 255, 255, 255 );
+
+  char name[1024];
+  snprintf( name, sizeof(name), "%s%08llu.ppm", Replay::dump_prefix, (long long unsigned)Robot::updates );
+  FILE* f( fopen( name, "wb" ) );
+  if( f == NULL || fprintf( f, "P6\n%u %u\n255\n", size, size ) < 0 ||
+      fwrite( image.data(), 1, image.size(), f ) != image.size() || fclose( f ) != 0 )
+    {
+      perror( "[Antix] dump" );
+      exit(-1); // error
+    }
+}
+
+// copy the decoded state into the world, for drawing
+static void Show()
+{
+  World& world( Robot::world );
+  const double worldsize( Robot::worldsize );
+
+  for( unsigned int i(0); i<header->robots; i++ )
+    {
+      world.x[i] = Position( robot_x[i], worldsize );
+      world.y[i] = Position( robot_y[i], worldsize );
+      world.a[i] = Angle( robot_a[i] );
+      world.held_puck[i] = robot_held[i] ? 0 : -1; // which puck is not recorded
+      if( Robot::show_data )
+	Robot::FovBBox( world.x[i], world.y[i], world.a[i], world.sensor_bbox[i] );
+    }
+
+  for( unsigned int i(0); i<header->pucks; i++ )
+    {
+      Puck* p( world.pucks[i] );
+      p->x = Position( puck_x[i], worldsize );
+      p->y = Position( puck_y[i], worldsize );
+      p->held = puck_held[i];
+      // a puck lying in a home is waiting to score there
+      p->home = p->held ? NULL : Home::Containing( p->x, p->y );
+    }
+
+  for( unsigned int h(0); h<header->homes; h++ )
+    Robot::homes[h]->score = score[h];
+
+  Robot::updates = frames[current].header->update;
+
+  checksum = Hash( checksum, robot_x.data(), robot_x.size() * sizeof(uint16_t) );
+  checksum = Hash( checksum, robot_y.data(), robot_y.size() * sizeof(uint16_t) );
+  checksum = Hash( checksum, robot_a.data(), robot_a.size() * sizeof(uint16_t) );
+  checksum = Hash( checksum, robot_held.data(), robot_held.size() );
+  checksum = Hash( checksum, puck_x.data(), puck_x.size() * sizeof(uint16_t) );
+  checksum = Hash( checksum, puck_y.data(), puck_y.size() * sizeof(uint16_t) );
+  checksum = Hash( checksum, puck_held.data(), puck_held.size() );
+  checksum = Hash( checksum, score.data(), score.size() * sizeof(int64_t) );
+  shown++;
+
+  if( Replay::dump_prefix )
+    Dump();
+}
+
+// decode frame f, starting from the nearest keyframe before it if
+// that is closer than the frame shown now
+static void GoTo( size_t f )
+{
+  f = std::min( f, frames.size() - 1 );
+
+  size_t start( f );
+  while( ! frames[start].keyframe )
+    start--;
+
+  if( f < current || start > current )
+    Decode( start );
+
+  while( current < f )
+    Decode( current + 1 );
+
+  Show();
+}
+
+void Replay::Start()
+{
+  for( unsigned int h(0); h<header->homes; h++ )
+    {
+      const home_record_t& rec( home_records[h] );
+      new Home( h, Home::Color( rec.red, rec.green, rec.blue ), rec.x, rec.y, rec.r );
+    }
+  Home::Index();
+
+  for( unsigned int i(0); i<header->robots; i++ )
+    new Replayed( Robot::homes[ home_ids[i] ] );
+
+  for( unsigned int i(0); i<header->pucks; i++ )
+    new Puck( 0, 0 );
+
+  robot_x.resize( header->robots );
+  robot_y.resize( header->robots );
+  robot_a.resize( header->robots );
+  robot_held.resize( header->robots );
+  puck_x.resize( header->pucks );
+  puck_y.resize( header->pucks );
+  puck_held.resize( header->pucks );
+  score.resize( header->homes );
+
+  Decode( 0 );
+  Show();
+
+  last_seconds = Now();
+}
+
+void Replay::Update()
+{
+  if( Robot::headless )
+    {
+      if( current + 1 < frames.size() &&
+	  ! (Robot::updates_max > 0 && frames[current + 1].header->update > Robot::updates_max) )
+	{
+	  Decode( current + 1 );
+	  Show();
+	  return;
+	}
+
+      printf( "[Antix] replay frames=%llu update=%llu checksum=%016llx\n",
+	      (long long unsigned)shown,
+	      (long long unsigned)Robot::updates,
+	      (long long unsigned)checksum );
+      exit(0);
+    }
+
+  // move on as many frames as the time since the last call is worth
+  const double now( Now() );
+  if( ! Robot::paused )
+    position += (now - last_seconds) * rate;
+  last_seconds = now;
+
+  if( position >= frames.size() - 1 )
+    {
+      position = frames.size() - 1;
+      Robot::paused = true; // at the end
+    }
+
+  if( (size_t)position != current )
+    GoTo( position );
+
+  // don't spin while there is nothing to do
+  usleep( 1000 );
+}
+
+static bool UpdateBefore( const frame_t& f, uint64_t update )
+{
+  return( f.header->update < update );
+}
+
+void Replay::Seek( uint64_t update )
+{
+  const size_t f( std::lower_bound( frames.begin(), frames.end(), update, UpdateBefore ) - frames.begin() );
+  position = std::min( f, frames.size() - 1 );
+  GoTo( position );
+}
+
+void Replay::Skip( double fraction )
+{
+  const double f( position + fraction * frames.size() );
+  position = std::max( 0.0, std::min( f, frames.size() - 1.0 ) );
+  GoTo( position );
+}
@@ -0,0 +1,234 @@
+/****
+     simd.cc
+     version 1
+     SSE2 and AVX2 versions of the sensor range and field of view tests
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include "antix.h"
+using namespace Antix;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// VBLEND( mask, a, b ) is a where mask is set, else b
+
+// The kernels work in real_t, so a single precision build tests twice
+// as many candidates per vector.
+#if SINGLE
+
+// SSE2: four lanes
+#define VNAME Antix::SenseKernelSSE2
+#define VTARGET __attribute__((target("sse2")))
+#define VLANES 4
+#define vreal __m128
+#define VSET1 _mm_set1_ps
+#define VLOAD _mm_loadu_ps
+#define VSTORE _mm_storeu_ps
+#define VADD _mm_add_ps
+#define VSUB _mm_sub_ps
+#define VMUL _mm_mul_ps
+#define VDIV _mm_div_ps
+#define VAND _mm_and_ps
+#define VOR _mm_or_ps
+#define VABS(a) _mm_andnot_ps( _mm_set1_ps(-0.0f), (a) )
+#define VLT _mm_cmplt_ps
+#define VLE _mm_cmple_ps
+#define VGT _mm_cmpgt_ps
+#define VEQ _mm_cmpeq_ps
+#define VBLEND(m,a,b) _mm_or_ps( _mm_and_ps( (m), (a) ), _mm_andnot_ps( (m), (b) ) )
+#define VMOVEMASK _mm_movemask_ps
+#include "simd.h"
+#undef VNAME
+#undef VTARGET
+#undef VLANES
+#undef vreal
+#undef VSET1
+#undef VLOAD
+#undef VSTORE
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VAND
+#undef VOR
+#undef VABS
+#undef VLT
+#undef VLE
+#undef VGT
+#undef VEQ
+#undef VBLEND
+#undef VMOVEMASK
+
+// AVX2: eight lanes
+#define VNAME Antix::SenseKernelAVX2
+#define VTARGET __attribute__((target("avx2")))
+#define VLANES 8
+#define vreal __m256
+#define VSET1 _mm256_set1_ps
+#define VLOAD _mm256_loadu_ps
+#define VSTORE _mm256_storeu_ps
+#define VADD _mm256_add_ps
+#define VSUB _mm256_sub_ps
+#define VMUL _mm256_mul_ps
+#define VDIV _mm256_div_ps
+#define VAND _mm256_and_ps
+#define VOR _mm256_or_ps
+#define VABS(a) _mm256_andnot_ps( _mm256_set1_ps(-0.0f), (a) )
+#define VLT(a,b) _mm256_cmp_ps( (a), (b), _CMP_LT_OQ )
+#define VLE(a,b) _mm256_cmp_ps( (a), (b), _CMP_LE_OQ )
+#define VGT(a,b) _mm256_cmp_ps( (a), (b), _CMP_GT_OQ )
+#define VEQ(a,b) _mm256_cmp_ps( (a), (b), _CMP_EQ_OQ )
+#define VBLEND(m,a,b) _mm256_blendv_ps( (b), (a), (m) )
+#define VMOVEMASK _mm256_movemask_ps
+#include "simd.h"
+#undef VNAME
+#undef VTARGET
+#undef VLANES
+#undef vreal
+#undef VSET1
+#undef VLOAD
+#undef VSTORE
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VAND
+#undef VOR
+#undef VABS
+#undef VLT
+#undef VLE
+#undef VGT
+#undef VEQ
+#undef VBLEND
+#undef VMOVEMASK
+
+#else // double precision
+
+// SSE2: two lanes
+#define VNAME Antix::SenseKernelSSE2
+#define VTARGET __attribute__((target("sse2")))
+#define VLANES 2
+#define vreal __m128d
+#define VSET1 _mm_set1_pd
+#define VLOAD _mm_loadu_pd
+#define VSTORE _mm_storeu_pd
+#define VADD _mm_add_pd
+#define VSUB _mm_sub_pd
+#define VMUL _mm_mul_pd
+#define VDIV _mm_div_pd
+#define VAND _mm_and_pd
+#define VOR _mm_or_pd
+#define VABS(a) _mm_andnot_pd( _mm_set1_pd(-0.0), (a) )
+#define VLT _mm_cmplt_pd
+#define VLE _mm_cmple_pd
+#define VGT _mm_cmpgt_pd
+#define VEQ _mm_cmpeq_pd
+#define VBLEND(m,a,b) _mm_or_pd( _mm_and_pd( (m), (a) ), _mm_andnot_pd( (m), (b) ) )
+#define VMOVEMASK _mm_movemask_pd
+#include "simd.h"
+#undef VNAME
+#undef VTARGET
+#undef VLANES
+#undef vreal
+#undef VSET1
+#undef VLOAD
+#undef VSTORE
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VAND
+#undef VOR
+#undef VABS
+#undef VLT
+#undef VLE
+#undef VGT
+#undef VEQ
+#undef VBLEND
+#undef VMOVEMASK
+
+// AVX2: four lanes
+#define VNAME Antix::SenseKernelAVX2
+#define VTARGET __attribute__((target("avx2")))
+#define VLANES 4
+#define vreal __m256d
+#define VSET1 _mm256_set1_pd
+#define VLOAD _mm256_loadu_pd
+#define VSTORE _mm256_storeu_pd
+#define VADD _mm256_add_pd
+#define VSUB _mm256_sub_pd
+#define VMUL _mm256_mul_pd
+#define VDIV _mm256_div_pd
+#define VAND _mm256_and_pd
+#define VOR _mm256_or_pd
+#define VABS(a) _mm256_andnot_pd( _mm256_set1_pd(-0.0), (a) )
+#define VLT(a,b) _mm256_cmp_pd( (a), (b), _CMP_LT_OQ )
+#define VLE(a,b) _mm256_cmp_pd( (a), (b), _CMP_LE_OQ )
+#define VGT(a,b) _mm256_cmp_pd( (a), (b), _CMP_GT_OQ )
+#define VEQ(a,b) _mm256_cmp_pd( (a), (b), _CMP_EQ_OQ )
+#define VBLEND(m,a,b) _mm256_blendv_pd( (b), (a), (m) )
+#define VMOVEMASK _mm256_movemask_pd
+#include "simd.h"
+#undef VNAME
+#undef VTARGET
+#undef VLANES
+#undef vreal
+#undef VSET1
+#undef VLOAD
+#undef VSTORE
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VAND
+#undef VOR
+#undef VABS
+#undef VLT
+#undef VLE
+#undef VGT
+#undef VEQ
+#undef VBLEND
+#undef VMOVEMASK
+
+#endif // SINGLE
+
+bool Antix::HaveSSE2()
+{
+  return __builtin_cpu_supports( "sse2" );
+}
+
+bool Antix::HaveAVX2()
+{
+  return __builtin_cpu_supports( "avx2" );
+}
+
+#else // not x86: only the scalar code is available
+
+unsigned int Antix::SenseKernelSSE2( const real_t* cx, const real_t* cy, unsigned int count,
+				     real_t x, real_t y, real_t a,
+				     unsigned int* found, real_t* ranges, real_t* bearings )
+{
+  assert( false );
+  return 0;
+}
+
+unsigned int Antix::SenseKernelAVX2( const real_t* cx, const real_t* cy, unsigned int count,
+				     real_t x, real_t y, real_t a,
+				     unsigned int* found, real_t* ranges, real_t* bearings )
+{
+  assert( false );
+  return 0;
+}
+
+bool Antix::HaveSSE2()
+{
+  return false;
+}
+
+bool Antix::HaveAVX2()
+{
+  return false;
+}
+
+#endif
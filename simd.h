@@ -0,0 +1,131 @@
+/****
+     simd.h
+     version 1
+     Body of the vectorized sensor kernel. Included by simd.cc once
+     per instruction set, after defining:
+       VNAME     name of the kernel function
+       VTARGET   function attributes selecting the instruction set
+       VLANES    number of real_t in a vector
+       vreal     the vector type
+       and the V* operations it uses
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+VTARGET unsigned int VNAME( const real_t* cx, const real_t* cy, unsigned int count,
+			    real_t x, real_t y, real_t a,
+			    unsigned int* found, real_t* ranges, real_t* bearings )
+{
+  const double halfworld( Robot::worldsize * 0.5 );
+  const real_t halffov( Robot::fov/2.0 );
+  const double piD2( M_PI/2.0 );
+
+  const vreal vx( VSET1( x ) );
+  const vreal vy( VSET1( y ) );
+  const vreal va( VSET1( a ) );
+  const vreal vworld( VSET1( Robot::worldsize ) );
+  const vreal vhalfworld( VSET1( halfworld ) );
+  const vreal vnhalfworld( VSET1( -halfworld ) );
+  const vreal vrange( VSET1( Robot::range ) );
+  const vreal vrngsqrd( VSET1( Robot::range * Robot::range ) );
+  const vreal vhalffov( VSET1( halffov ) );
+  const vreal vzero( VSET1( 0.0 ) );
+  const vreal vone( VSET1( 1.0 ) );
+  const vreal vk( VSET1( 0.28 ) );
+  const vreal vkf( VSET1( 0.28f ) ); // fast_atan2 uses both
+  const vreal vpi( VSET1( M_PI ) );
+  const vreal vnpi( VSET1( -M_PI ) );
+  const vreal vtwopi( VSET1( 2.0*M_PI ) );
+  const vreal vpid2( VSET1( piD2 ) );
+  const vreal vnpid2( VSET1( -piD2 ) );
+
+  unsigned int n(0);
+
+  for( unsigned int i(0); i<count; i+=VLANES )
+    {
+      // WrapDistance()
+      const vreal rawx( VSUB( VLOAD( cx+i ), vx ) );
+      const vreal dx( VBLEND( VGT( rawx, vhalfworld ), VSUB( rawx, vworld ),
+				VBLEND( VLT( rawx, vnhalfworld ), VADD( rawx, vworld ), rawx ) ) );
+
+      const vreal rawy( VSUB( VLOAD( cy+i ), vy ) );
+      const vreal dy( VBLEND( VGT( rawy, vhalfworld ), VSUB( rawy, vworld ),
+				VBLEND( VLT( rawy, vnhalfworld ), VADD( rawy, vworld ), rawy ) ) );
+
+      const vreal dsq( VADD( VMUL( dx, dx ), VMUL( dy, dy ) ) );
+
+      // fast_atan2( dy, dx ), evaluating every branch
+      const vreal z( VDIV( dy, dx ) );
+      const vreal small( VLT( VABS( z ), vone ) );
+      const vreal xneg( VLT( dx, vzero ) );
+      const vreal yneg( VLT( dy, vzero ) );
+
+      const vreal near( VDIV( z, VADD( vone, VMUL( VMUL( vk, z ), z ) ) ) );
+      const vreal near_turned( VBLEND( yneg, VSUB( near, vpi ), VADD( near, vpi ) ) );
+      const vreal near_result( VBLEND( xneg, near_turned, near ) );
+
+      const vreal far( VSUB( vpid2, VDIV( z, VADD( VMUL( z, z ), vkf ) ) ) );
+      const vreal far_result( VBLEND( yneg, VSUB( far, vpi ), far ) );
+
+      vreal heading( VBLEND( small, near_result, far_result ) );
+
+      const vreal zero_x( VBLEND( VGT( dy, vzero ), vpid2,
+				    VBLEND( VEQ( dy, vzero ), vzero, vnpid2 ) ) );
+      heading = VBLEND( VEQ( dx, vzero ), zero_x, heading );
+
+      // AngleNormalize( heading - a ), one step at most
+      vreal rel( VSUB( heading, va ) );
+      rel = VBLEND( VLT( rel, vnpi ), VADD( rel, vtwopi ), rel );
+      rel = VBLEND( VGT( rel, vpi ), VSUB( rel, vtwopi ), rel );
+
+      // the range tests
+      const vreal inrange( VAND( VAND( VLE( VABS( dx ), vrange ), VLE( VABS( dy ), vrange ) ),
+				   VLE( dsq, vrngsqrd ) ) );
+
+      int mask( VMOVEMASK( inrange ) );
+      if( count - i < VLANES ) // ignore the padding
+	mask &= (1 << (count - i)) - 1;
+
+      if( mask == 0 )
+	continue;
+
+      // the field of view test
+      const int infov( VMOVEMASK( VLE( VABS( rel ), vhalffov ) ) );
+
+      // a heading that needs more than one step to normalize is
+      // handed to the scalar code, to match it exactly
+      const int wild( VMOVEMASK( VOR( VLT( rel, vnpi ), VGT( rel, vpi ) ) ) );
+
+      real_t rels[VLANES], dsqs[VLANES];
+      VSTORE( rels, rel );
+      VSTORE( dsqs, dsq );
+
+      // compact the survivors
+      for( unsigned int l(0); l<VLANES; l++ )
+	{
+	  const int bit( 1 << l );
+	  if( !(mask & bit) )
+	    continue;
+
+	  real_t bearing( rels[l] );
+	  bool visible( infov & bit );
+
+	  if( wild & bit )
+	    {
+	      const real_t ddx( Robot::WrapDistance( cx[i+l] - x ) );
+	      const real_t ddy( Robot::WrapDistance( cy[i+l] - y ) );
+	      bearing = Robot::AngleNormalize( fast_atan2( ddy, ddx ) - a );
+	      visible = ( fabs(bearing) <= halffov );
+	    }
+
+	  if( visible )
+	    {
+	      found[n] = i+l;
+	      ranges[n] = sqrt( dsqs[l] );
+	      bearings[n] = bearing;
+	      n++;
+	    }
+	}
+    }
+
+  return n;
+}
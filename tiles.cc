@@ -0,0 +1,660 @@
+/****
+     tiles.cc
+     version 1
+     Splits the world into strips simulated by separate processes,
+     which swap robots, pucks and edge columns through shared memory
+     Clone this package from git://github.com/rtv/Antix.git
+****/
+
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "antix.h"
+using namespace Antix;
+
+unsigned int Tiles::count(0);
+unsigned int Tiles::index(0);
+unsigned int Tiles::first_column(0);
+unsigned int Tiles::last_column(0);
+std::vector<char> Tiles::own_robot;
+std::vector<char> Tiles::own_puck;
+
+// Each tile has a region of shared memory that only it writes,
+// laid out as
+//   header | sections[count] | scores[homes] | records...
+// Section t holds what this tile sends to tile t this update, at
+// offset bytes from the start of the region:
+//   migrant_t[robots] | tile_puck_t[pucks] |
+//   ghost_t[ghost_robots] | tile_puck_t[ghost_pucks] |
+//   controller state[state_bytes]
+// A tile fills in its sections, then sets seq to the update
+// number. Once it has read every other tile's section for it, it
+// sets ack. It only writes again once every tile has acked, so the
+// region may grow between updates and readers follow.
+
+typedef struct
+{
+  volatile uint64_t seq; // update whose sections are ready
+  char pad0[56];
+  volatile uint64_t ack; // update whose incoming sections this tile has read
+  char pad1[56];
+  volatile uint64_t finished; // 1 once the results below are final
+  char pad2[56];
+  volatile uint64_t size; // bytes in the region
+  uint64_t seen_robots, seen_pucks; // this tile's detections over the run
+} tile_header_t;
+
+typedef struct
+{
+  uint64_t offset;
+  unsigned int robots, pucks, ghost_robots, ghost_pucks;
+  uint64_t state_bytes;
+} tile_section_t;
+
+// a robot moving to another tile
+typedef struct
+{
+  unsigned int slot;
+  int held_puck; // carried along with it, or -1
+  double x, y, a, v, w;
+  uint64_t state_bytes; // of Robot::Save()
+} migrant_t;
+
+// a robot in an edge column
+typedef struct
+{
+  unsigned int slot;
+  int held_puck;
+  double x, y, a;
+} ghost_t;
+
+// a puck moving to another tile, or in an edge column
+typedef struct
+{
+  unsigned int id;
+  int held;
+  double x, y;
+} tile_puck_t;
+
+// what this tile sends another this update
+typedef struct
+{
+  std::vector<migrant_t> robots;
+  std::vector<tile_puck_t> pucks;
+  std::vector<ghost_t> ghost_robots;
+  std::vector<tile_puck_t> ghost_pucks;
+  std::vector<char> state;
+} outbox_t;
+
+typedef struct
+{
+  int fd;
+  char* base;
+  size_t mapped; // bytes of the region mapped by this process
+} tile_region_t;
+
+static std::vector<tile_region_t> regions; // indexed by tile
+static std::vector<outbox_t> outboxes; // indexed by destination tile
+static std::vector<unsigned int> column_tile; // the tile owning each matrix column
+static std::vector<unsigned int> departing; // pucks replaced into another tile this update
+static std::vector<unsigned int> emigrants; // robots that left this tile this update
+static std::vector<pid_t> pids;
+static pid_t parent(0);
+
+static inline tile_header_t* Header( tile_region_t& r )
+{
+  return( (tile_header_t*)r.base );
+}
+
+static inline tile_section_t* Sections( tile_region_t& r )
+{
+  return( (tile_section_t*)(r.base + sizeof(tile_header_t)) );
+}
+
+static inline uint32_t* Scores( tile_region_t& r )
+{
+  return( (uint32_t*)(Sections( r ) + Tiles::count) );
+}
+
+// the first byte after the fixed part of a region, rounded up so the
+// records are aligned
+static inline size_t RecordsOffset()
+{
+  const size_t bytes( sizeof(tile_header_t) + Tiles::count * sizeof(tile_section_t) +
+		      Robot::homes.size() * sizeof(uint32_t) );
+  return( (bytes + 7) & ~(size_t)7 );
+}
+
+static inline size_t SectionBytes( const outbox_t& o )
+{
+  const size_t bytes( o.robots.size() * sizeof(migrant_t) +
+		      o.pucks.size() * sizeof(tile_puck_t) +
+		      o.ghost_robots.size() * sizeof(ghost_t) +
+		      o.ghost_pucks.size() * sizeof(tile_puck_t) +
+		      o.state.size() );
+  return( (bytes + 7) & ~(size_t)7 );
+}
+
+static inline unsigned int Column( unsigned int cell )
+{
+  return( cell % Robot::matrixwidth );
+}
+
+static inline bool Owns( unsigned int cell )
+{
+  const unsigned int c( Column( cell ) );
+  return( c >= Tiles::first_column && c < Tiles::last_column );
+}
+
+// true iff the cell is in the column either side of this tile
+static inline bool IsGhost( unsigned int cell )
+{
+  const unsigned int width( Robot::matrixwidth );
+  const unsigned int c( Column( cell ) );
+  return( c == (Tiles::first_column + width - 1) % width || c == Tiles::last_column % width );
+}
+
+static void Map( tile_region_t& r, size_t size )
+{
+  if( r.base )
+    munmap( r.base, r.mapped );
+
+  r.base = (char*)mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, r.fd, 0 );
+  if( r.base == MAP_FAILED )
+    {
+      perror( "[Antix] mmap" );
+      exit(-1);
+    }
+  r.mapped = size;
+}
+
+// make our region at least this big
+static void Grow( tile_region_t& r, size_t size )
+{
+  if( ftruncate( r.fd, size ) != 0 )
+    {
+      perror( "[Antix] ftruncate" );
+      exit(-1);
+    }
+  Map( r, size );
+  Header( r )->size = size;
+}
+
+// wait for a counter in another tile's region to reach a value,
+// spinning, then yielding, then sleeping, as Remote does. A tile
+// quits if the first tile has gone, and the first tile quits if any
+// other has.
+static void WaitFor( volatile uint64_t* counter, uint64_t value )
+{
+  for( unsigned int tries(0); *counter < value; tries++ )
+    {
+      if( tries < 100 )
+	continue;
+
+      if( tries < 200 )
+	sched_yield();
+      else
+	{
+	  usleep( std::min( 1000u, tries - 200 ) );
+
+	  if( Tiles::index && getppid() != parent )
+	    _exit(0);
+	  if( Tiles::index == 0 && waitpid( -1, NULL, WNOHANG ) > 0 )
+	    {
+	      fprintf( stderr, "[Antix] a tile process has died\n" );
+	      exit(-1);
+	    }
+	}
+    }
+
+  __sync_synchronize(); // see everything written before the counter
+}
+
+// forget everything outside this tile, which its owner updates
+static void Claim()
+{
+  World& world( Robot::world );
+  const unsigned int cells( Robot::matrix.size() );
+
+  Tiles::own_robot.assign( world.RobotCount(), 0 );
+  for( unsigned int s(0); s<world.RobotCount(); s++ )
+    Tiles::own_robot[s] = Owns( world.cell[s] );
+
+  Tiles::own_puck.assign( world.pucks.size(), 0 );
+  for( unsigned int p(0); p<world.pucks.size(); p++ )
+    Tiles::own_puck[p] = Owns( world.pucks[p]->index );
+
+  for( unsigned int c(0); c<cells; c++ )
+    if( ! Owns( c ) )
+      {
+	std::vector<unsigned int>().swap( Robot::matrix[c].robots );
+	std::vector<unsigned int>().swap( Robot::matrix[c].pucks );
+      }
+
+  // only our own pucks score here
+  std::vector<Puck*> waiting, ours;
+  Home::WaitingPucks( waiting );
+  FOR_EACH( p, waiting )
+    if( Tiles::own_puck[ (*p)->id ] )
+      ours.push_back( *p );
+  Home::SetWaitingPucks( ours );
+
+  FOR_EACH( h, Robot::homes )
+    (*h)->pucks = 0;
+  FOR_EACH( p, world.pucks )
+    if( ! Tiles::own_puck[ (*p)->id ] )
+      (*p)->home = NULL;
+  FOR_EACH( p, ours )
+    (*p)->home->pucks++;
+
+  unsigned int robots(0);
+  for( unsigned int s(0); s<world.RobotCount(); s++ )
+    robots += Tiles::own_robot[s];
+  printf( "[Antix] tile %u has columns %u to %u and %u robots\n",
+	  Tiles::index, Tiles::first_column, Tiles::last_column - 1, robots );
+}
+
+void Tiles::Start()
+{
+  const unsigned int width( Robot::matrixwidth );
+
+  column_tile.resize( width );
+  for( unsigned int c(0); c<width; c++ )
+    column_tile[c] = (uint64_t)c * count / width;
+
+  regions.resize( count );
+  outboxes.resize( count );
+  parent = getpid();
+
+  for( unsigned int t(0); t<count; t++ )
+    {
+      tile_region_t& r( regions[t] );
+
+      // the name is removed at once, leaving just the descriptor
+      // for the tile processes to inherit
+      char name[64];
+      snprintf( name, sizeof(name), "/antix-tile.%d.%u", (int)parent, t );
+      r.fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL, 0600 );
+      if( r.fd < 0 )
+	{
+	  perror( "[Antix] shm_open" );
+	  exit(-1);
+	}
+      shm_unlink( name );
+
+      r.base = NULL;
+      Grow( r, RecordsOffset() );
+    }
+
+  // nothing buffered for output should be written twice
+  fflush( stdout );
+  fflush( stderr );
+
+  for( unsigned int t(1); t<count; t++ )
+    {
+      const pid_t pid( fork() );
+      if( pid < 0 )
+	{
+	  perror( "[Antix] fork" );
+	  exit(-1);
+	}
+
+      if( pid == 0 )
+	{
+	  index = t;
+	  pids.clear();
+
+	  // fork() leaves only this thread, so start the workers again
+	  const unsigned int active( Pool::active );
+	  Pool::Init( Pool::threads );
+	  Pool::active = active;
+	  break;
+	}
+
+      pids.push_back( pid );
+    }
+
+  first_column = (index * width + count - 1) / count;
+  last_column = ((index + 1) * width + count - 1) / count;
+  Claim();
+
+  // the first tile speaks for them all
+  if( index )
+    {
+      fflush( stdout );
+      if( freopen( "/dev/null", "w", stdout ) == NULL )
+	perror( "[Antix] tile output" );
+    }
+}
+
+bool Tiles::Replaced( const Puck* puck )
+{
+  if( Owns( Robot::Cell( puck->x, puck->y ) ) )
+    return false;
+
+  departing.push_back( puck->id );
+  return true;
+}
+
+// queue a robot that has left this tile, and the puck it carries,
+// for the tile it is in now
+static void Emigrate( unsigned int slot )
+{
+  World& world( Robot::world );
+  const unsigned int cell( world.cell[slot] );
+  outbox_t& out( outboxes[ column_tile[ Column( cell ) ] ] );
+
+  migrant_t rec;
+  memset( &rec, 0, sizeof(rec) );
+  rec.slot = slot;
+  rec.held_puck = world.held_puck[slot];
+  rec.x = world.x[slot];
+  rec.y = world.y[slot];
+  rec.a = world.a[slot];
+  rec.v = world.v[slot];
+  rec.w = world.w[slot];
+
+  const size_t before( out.state.size() );
+  world.handle[slot]->Save( out.state );
+  rec.state_bytes = out.state.size() - before;
+  out.robots.push_back( rec );
+
+  Robot::matrix[cell].RemoveRobot( slot );
+  Tiles::own_robot[slot] = 0;
+  emigrants.push_back( slot );
+
+  if( rec.held_puck >= 0 )
+    {
+      Robot::matrix[cell].RemovePuck( rec.held_puck );
+      Tiles::own_puck[ rec.held_puck ] = 0;
+    }
+}
+
+// queue the contents of one of our edge columns for a neighbour
+static void SendColumn( unsigned int column, outbox_t& out )
+{
+  const World& world( Robot::world );
+  const unsigned int width( Robot::matrixwidth );
+
+  for( unsigned int y(0); y<width; y++ )
+    {
+      const Robot::MatrixCell& cell( Robot::matrix[ column + y * width ] );
+
+      FOR_EACH( s, cell.robots )
+	{
+	  const ghost_t g = { *s, world.held_puck[*s], world.x[*s], world.y[*s], world.a[*s] };
+	  out.ghost_robots.push_back( g );
+	}
+
+      FOR_EACH( id, cell.pucks )
+	{
+	  const Puck* p( world.pucks[*id] );
+	  const tile_puck_t g = { p->id, p->held, p->x, p->y };
+	  out.ghost_pucks.push_back( g );
+	}
+    }
+}
+
+// write the outboxes into our region and publish them
+static void Publish()
+{
+  tile_region_t& r( regions[ Tiles::index ] );
+
+  size_t size( RecordsOffset() );
+  for( unsigned int t(0); t<Tiles::count; t++ )
+    size += SectionBytes( outboxes[t] );
+  if( size > r.mapped )
+    Grow( r, 2 * size );
+
+  size_t offset( RecordsOffset() );
+  for( unsigned int t(0); t<Tiles::count; t++ )
+    {
+      outbox_t& o( outboxes[t] );
+      tile_section_t& sec( Sections( r )[t] );
+      sec.offset = offset;
+      sec.robots = o.robots.size();
+      sec.pucks = o.pucks.size();
+      sec.ghost_robots = o.ghost_robots.size();
+      sec.ghost_pucks = o.ghost_pucks.size();
+      sec.state_bytes = o.state.size();
+
+      char* p( r.base + offset );
+      memcpy( p, o.robots.data(), o.robots.size() * sizeof(migrant_t) );
+      p += o.robots.size() * sizeof(migrant_t);
+      memcpy( p, o.pucks.data(), o.pucks.size() * sizeof(tile_puck_t) );
+      p += o.pucks.size() * sizeof(tile_puck_t);
+      memcpy( p, o.ghost_robots.data(), o.ghost_robots.size() * sizeof(ghost_t) );
+      p += o.ghost_robots.size() * sizeof(ghost_t);
+      memcpy( p, o.ghost_pucks.data(), o.ghost_pucks.size() * sizeof(tile_puck_t) );
+      p += o.ghost_pucks.size() * sizeof(tile_puck_t);
+      memcpy( p, o.state.data(), o.state.size() );
+
+      offset += SectionBytes( o );
+
+      o.robots.clear();
+      o.pucks.clear();
+      o.ghost_robots.clear();
+      o.ghost_pucks.clear();
+      o.state.clear();
+    }
+
+  __sync_synchronize(); // everything above before the counter
+  Header( r )->seq = Robot::updates + 1;
+}
+
+// place a puck in the matrix at its position
+static void PlacePuck( Puck* puck )
+{
+  puck->index = Robot::Cell( puck->x, puck->y );
+  Robot::matrix[ puck->index ].AddPuck( puck->id );
+}
+
+// take in what another tile sent us
+static void Receive( tile_region_t& r )
+{
+  World& world( Robot::world );
+
+  if( Header( r )->size > r.mapped )
+    Map( r, Header( r )->size );
+
+  const tile_section_t& sec( Sections( r )[ Tiles::index ] );
+  const char* p( r.base + sec.offset );
+  const migrant_t* robots( (const migrant_t*)p );
+  p += sec.robots * sizeof(migrant_t);
+  const tile_puck_t* pucks( (const tile_puck_t*)p );
+  p += sec.pucks * sizeof(tile_puck_t);
+  const ghost_t* ghost_robots( (const ghost_t*)p );
+  p += sec.ghost_robots * sizeof(ghost_t);
+  const tile_puck_t* ghost_pucks( (const tile_puck_t*)p );
+  p += sec.ghost_pucks * sizeof(tile_puck_t);
+  const char* state( p );
+
+  // robots arriving in this tile, with the pucks they carry
+  for( unsigned int i(0); i<sec.robots; i++ )
+    {
+      const migrant_t& rec( robots[i] );
+      const unsigned int s( rec.slot );
+
+      world.x[s] = rec.x;
+      world.y[s] = rec.y;
+      world.a[s] = rec.a;
+      world.v[s] = rec.v;
+      world.w[s] = rec.w;
+      world.held_puck[s] = rec.held_puck;
+      world.claim[s] = -1;
+      world.dropping[s] = false;
+      world.handle[s]->Load( state );
+
+      const unsigned int cell( Robot::Cell( world.x[s], world.y[s] ) );
+      assert( Owns( cell ) );
+      Robot::matrix[cell].AddRobot( s );
+      world.cell[s] = cell;
+      Robot::FovBBox( world.x[s], world.y[s], world.a[s], world.sensor_bbox[s] );
+      Tiles::own_robot[s] = 1;
+
+      if( rec.held_puck >= 0 )
+	{
+	  Puck* puck( world.pucks[ rec.held_puck ] );
+	  puck->x = world.x[s];
+	  puck->y = world.y[s];
+	  puck->held = true;
+	  puck->home = NULL;
+	  puck->index = cell;
+	  Robot::matrix[cell].AddPuck( puck->id );
+	  Tiles::own_puck[ puck->id ] = 1;
+	}
+    }
+
+  // pucks replaced into this tile, which are dropped here
+  for( unsigned int i(0); i<sec.pucks; i++ )
+    {
+      Puck* puck( world.pucks[ pucks[i].id ] );
+      puck->x = pucks[i].x;
+      puck->y = pucks[i].y;
+      puck->home = NULL;
+      PlacePuck( puck );
+      assert( Owns( puck->index ) );
+      Tiles::own_puck[ puck->id ] = 1;
+      puck->Drop();
+    }
+
+  // the neighbour's edge column, which our robots can see
+  for( unsigned int i(0); i<sec.ghost_robots; i++ )
+    {
+      const ghost_t& g( ghost_robots[i] );
+      world.x[g.slot] = g.x;
+      world.y[g.slot] = g.y;
+      world.a[g.slot] = g.a;
+      world.held_puck[g.slot] = g.held_puck;
+      const unsigned int cell( Robot::Cell( world.x[g.slot], world.y[g.slot] ) );
+      Robot::matrix[cell].AddRobot( g.slot );
+      world.cell[g.slot] = cell;
+    }
+
+  for( unsigned int i(0); i<sec.ghost_pucks; i++ )
+    {
+      Puck* puck( world.pucks[ ghost_pucks[i].id ] );
+      puck->x = ghost_pucks[i].x;
+      puck->y = ghost_pucks[i].y;
+      puck->held = ghost_pucks[i].held;
+      PlacePuck( puck );
+    }
+}
+
+void Tiles::Exchange()
+{
+  World& world( Robot::world );
+  const unsigned int width( Robot::matrixwidth );
+
+  // our region may be rewritten once everyone has read the last update's
+  for( unsigned int t(0); t<count; t++ )
+    if( t != index )
+      WaitFor( &Header( regions[t] )->ack, Robot::updates );
+
+  // robots that have moved out, in slot order, and pucks that have
+  // been replaced elsewhere
+  for( unsigned int s(0); s<world.RobotCount(); s++ )
+    if( own_robot[s] && ! Owns( world.cell[s] ) )
+      Emigrate( s );
+
+  FOR_EACH( id, departing )
+    {
+      Puck* puck( world.pucks[*id] );
+      Robot::matrix[ puck->index ].RemovePuck( puck->id );
+      own_puck[ puck->id ] = 0;
+
+      const tile_puck_t rec = { puck->id, puck->held, puck->x, puck->y };
+      outboxes[ column_tile[ Column( puck->index ) ] ].pucks.push_back( rec );
+    }
+
+  // our edge columns, for the neighbours either side
+  SendColumn( first_column, outboxes[ column_tile[ (first_column + width - 1) % width ] ] );
+  SendColumn( last_column - 1, outboxes[ column_tile[ last_column % width ] ] );
+
+  // last update's ghosts are out of date
+  const unsigned int ghost_columns[2] = { (first_column + width - 1) % width, last_column % width };
+  for( unsigned int g(0); g<2; g++ )
+    for( unsigned int y(0); y<width; y++ )
+      {
+	Robot::MatrixCell& cell( Robot::matrix[ ghost_columns[g] + y * width ] );
+	cell.robots.clear();
+	cell.pucks.clear();
+      }
+
+  // robots move at most a column per update, so those that just left
+  // are in the neighbours' edge columns, which their owners sent
+  // before taking them in. We have them up to date already.
+  FOR_EACH( s, emigrants )
+    {
+      const unsigned int cell( world.cell[*s] );
+      if( IsGhost( cell ) )
+	{
+	  Robot::matrix[cell].AddRobot( *s );
+	  if( world.held_puck[*s] >= 0 )
+	    Robot::matrix[cell].AddPuck( world.held_puck[*s] );
+	}
+    }
+  emigrants.clear();
+
+  FOR_EACH( id, departing )
+    {
+      const Puck* puck( world.pucks[*id] );
+      if( IsGhost( puck->index ) )
+	Robot::matrix[ puck->index ].AddPuck( puck->id );
+    }
+  departing.clear();
+
+  Publish();
+
+  for( unsigned int t(0); t<count; t++ )
+    if( t != index )
+      {
+	WaitFor( &Header( regions[t] )->seq, Robot::updates + 1 );
+	Receive( regions[t] );
+      }
+
+  __sync_synchronize(); // done reading before the counter
+  Header( regions[index] )->ack = Robot::updates + 1;
+}
+
+void Tiles::Finish( uint64_t& seen_robots, uint64_t& seen_pucks )
+{
+  tile_region_t& mine( regions[index] );
+
+  if( index )
+    {
+      // leave our results for the first tile, and wait for it to
+      // collect them
+      for( unsigned int h(0); h<Robot::homes.size(); h++ )
+	Scores( mine )[h] = Robot::homes[h]->score;
+      Header( mine )->seen_robots = seen_robots;
+      Header( mine )->seen_pucks = seen_pucks;
+      __sync_synchronize();
+      Header( mine )->finished = 1;
+
+      WaitFor( &Header( regions[0] )->finished, 1 );
+      _exit(0);
+    }
+
+  for( unsigned int t(1); t<count; t++ )
+    {
+      tile_region_t& r( regions[t] );
+      WaitFor( &Header( r )->finished, 1 );
+      if( Header( r )->size > r.mapped )
+	Map( r, Header( r )->size );
+
+      for( unsigned int h(0); h<Robot::homes.size(); h++ )
+	Robot::homes[h]->score += Scores( r )[h];
+      seen_robots += Header( r )->seen_robots;
+      seen_pucks += Header( r )->seen_pucks;
+    }
+
+  Header( mine )->finished = 1;
+  FOR_EACH( pid, pids )
+    waitpid( *pid, NULL, 0 );
+  pids.clear();
+}